@@ -47,22 +47,94 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <ctype.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/stat.h>
 
 #define SESS_PRIVATE
 #define NEED_KRB5
 #include "rekeysrv-locl.h"
 #include "rekey-locl.h"
 
-struct ACL {
-  struct ACL *next;
+/*
+ * An ACL is compiled when it is loaded.  The entries are kept in file
+ * order, and are also hashed into buckets.  Entries with no wildcards
+ * are keyed by the whole principal; the rest are keyed by component
+ * count, first component, and whether the last component is "**".  A
+ * lookup visits only the buckets a subject could possibly match, walking
+ * them together in file order, so the first matching entry wins just as
+ * it does when scanning the whole list.
+ */
+struct acl_entry {
+  struct acl_entry *next;       /* next entry in file order */
+  struct acl_entry *chain;      /* next entry in the same bucket */
+  int seq;
   int negative;
+  int ncomp;
+  int dstar;
   krb5_principal pattern;
 };
 
+#define ACL_KEY_FIXED   0       /* ncomp components, first one given */
+#define ACL_KEY_DSTAR   1       /* ditto, but the last one is "**" */
+#define ACL_KEY_LITERAL 2       /* exactly this principal */
+
+struct acl_bucket {
+  struct acl_bucket *next;
+  unsigned int hash;
+  int ncomp;
+  int kind;
+  size_t klen;
+  char *key;
+  struct acl_entry *head, **tail;
+};
+
+struct ACL {
+  struct acl_entry *entries;
+  int nentries;
+  unsigned int nbuckets;
+  struct acl_bucket **table;
+  int max_dstar;                /* most components in a "**" entry */
+  int ncursor;                  /* buckets being walked by acl_check() */
+  struct acl_entry **cursor;
+  size_t keysize;
+  char *keybuf;
+};
+
 static int pattern_match(krb5_context, char *, krb5_principal,
            krb5_principal pattern) __attribute__((nonnull (1, 2, 3, 4)));
 #if defined(KRB5_PRINCIPAL_HEIMDAL_STYLE)
 
+static int princ_ncomp(krb5_context ctx, krb5_principal p)
+{
+  int i;
+
+  for (i = 0; krb5_principal_get_comp_string(ctx, p, i); i++);
+  return i;
+}
+
+/* Returns component i of p (not necessarily NUL-terminated), or "" */
+static const char *princ_comp(krb5_context ctx, krb5_principal p, int i,
+                              size_t *len)
+{
+  const char *comp = krb5_principal_get_comp_string(ctx, p, i);
+
+  if (!comp)
+    comp = "";
+  *len = strlen(comp);
+  return comp;
+}
+
+/* Returns the realm of p (not necessarily NUL-terminated), or NULL */
+static const char *princ_realm(krb5_context ctx, krb5_principal p,
+                               size_t *len)
+{
+  const char *realm = krb5_principal_get_realm(ctx, p);
+
+  *len = realm ? strlen(realm) : 0;
+  return realm;
+}
+
 /* Returns 1 iff subject matches pattern, component-wise */
 static int pattern_match(krb5_context ctx, char *lrealm,
                          krb5_principal subject, krb5_principal pattern)
@@ -111,12 +183,46 @@ static int pattern_match(krb5_context ctx, char *lrealm,
 
 #elif defined(KRB5_PRINCIPAL_MIT_STYLE)
 
+static int princ_ncomp(krb5_context ctx, krb5_principal p)
+{
+  return krb5_princ_size(ctx, p);
+}
+
+/* Returns component i of p (not necessarily NUL-terminated), or "" */
+static const char *princ_comp(krb5_context ctx, krb5_principal p, int i,
+                              size_t *len)
+{
+  krb5_data *comp;
+
+  if (i >= krb5_princ_size(ctx, p)) {
+    *len = 0;
+    return "";
+  }
+  comp = krb5_princ_component(ctx, p, i);
+  *len = comp->length;
+  return comp->data;
+}
+
+/* Returns the realm of p (not necessarily NUL-terminated), or NULL */
+static const char *princ_realm(krb5_context ctx, krb5_principal p,
+                               size_t *len)
+{
+  krb5_data *realm = krb5_princ_realm(ctx, p);
+
+  if (!realm || !realm->data) {
+    *len = 0;
+    return NULL;
+  }
+  *len = realm->length;
+  return realm->data;
+}
+
 /* Returns 1 iff component <key> matches component pattern <pat>. */
 static int kdcmp(krb5_data *key, krb5_data *pat)
 {
   if (pat->length == 1 && pat->data[0] == '*') return 1;
   if (pat->length != key->length) return 0;
-  return !memcpy(pat->data, key->data, pat->length);
+  return !memcmp(pat->data, key->data, pat->length);
 }
 
 /* Returns 1 iff subject matches pattern, component-wise */
@@ -151,7 +257,8 @@ static int pattern_match(krb5_context ctx, char *lrealm,
      * the match succeeds as soon as that component is encountered,
      * regardless of how many components are left in the subject.
      */
-    if (pcomp->length == 2 && !strncmp(pcomp->data, "**", 2))
+    if (i == plen - 1 && pcomp->length == 2 &&
+        !strncmp(pcomp->data, "**", 2))
       return 1;
 
     /*
@@ -174,10 +281,11 @@ static int pattern_match(krb5_context ctx, char *lrealm,
 #endif
 
 
-static struct ACL *parse_entry(struct rekey_session *sess,
-                               char *file, int line, char *str)
+static struct acl_entry *parse_entry(struct rekey_session *sess,
+                                     char *file, int line, char *str,
+                                     int *errors)
 {
-  struct ACL *entry;
+  struct acl_entry *entry;
   char *x;
   int rc;
 
@@ -189,10 +297,11 @@ static struct ACL *parse_entry(struct rekey_session *sess,
     *x = 0;
   if (!strcmp(str, "!")) {
     prtmsg("%s[%d]: Invalid empty negative ACL entry", file, line);
+    (*errors)++;
     return NULL;
   }
 
-  entry = malloc(sizeof(struct ACL));
+  entry = malloc(sizeof(struct acl_entry));
   if (!entry)
     fatal("%s[%d]: Out of memory\n", file, line);
   memset(entry, 0, sizeof(*entry));
@@ -204,48 +313,233 @@ static struct ACL *parse_entry(struct rekey_session *sess,
   if ((rc = krb5_parse_name(sess->kctx, str, &entry->pattern))) {
     prtmsg("%s[%d]: %s", file, line, krb5_get_err_text(sess->kctx, rc));
     free(entry);
+    (*errors)++;
     return NULL;
   }
   return entry;
 }
 
 
-struct ACL *acl_load(struct rekey_session *sess, char *file)
+static unsigned int acl_hash(int ncomp, int kind, const char *key,
+                             size_t klen)
+{
+  unsigned int h = 2166136261U;
+
+  while (klen--) {
+    h ^= (unsigned char)*key++;
+    h *= 16777619U;
+  }
+  h ^= (unsigned int)ncomp * 4 + kind;
+  h *= 16777619U;
+  return h;
+}
+
+
+static struct acl_bucket *acl_bucket(struct ACL *acl, int ncomp, int kind,
+                                     const char *key, size_t klen)
+{
+  struct acl_bucket *b;
+  unsigned int h;
+
+  h = acl_hash(ncomp, kind, key, klen);
+  for (b = acl->table[h % acl->nbuckets]; b; b = b->next) {
+    if (b->hash == h && b->ncomp == ncomp && b->kind == kind &&
+        b->klen == klen && !memcmp(b->key, key, klen))
+      return b;
+  }
+  return NULL;
+}
+
+
+/*
+ * Returns the key under which a principal with no wildcards is indexed:
+ * its components and realm, separated by NULs.  The key is built in a
+ * buffer belonging to the ACL, and is only good until the next call.
+ */
+static const char *literal_key(krb5_context ctx, struct ACL *acl,
+                               krb5_principal p, int ncomp, size_t *klen)
+{
+  const char *comp, *realm;
+  size_t len, rlen, need;
+  char *x;
+  int i;
+
+  if (!(realm = princ_realm(ctx, p, &rlen)))
+    return NULL;
+  need = rlen;
+  for (i = 0; i < ncomp; i++) {
+    princ_comp(ctx, p, i, &len);
+    need += len + 1;
+  }
+  if (need > acl->keysize) {
+    x = realloc(acl->keybuf, need);
+    if (!x)
+      fatal("Out of memory\n");
+    acl->keybuf = x;
+    acl->keysize = need;
+  }
+
+  x = acl->keybuf;
+  for (i = 0; i < ncomp; i++) {
+    comp = princ_comp(ctx, p, i, &len);
+    memcpy(x, comp, len);
+    x += len;
+    *x++ = 0;
+  }
+  memcpy(x, realm, rlen);
+  *klen = need;
+  return acl->keybuf;
+}
+
+
+/* Returns 1 iff entry can only ever match a principal identical to it */
+static int is_literal(krb5_context ctx, struct acl_entry *entry)
+{
+  const char *comp;
+  size_t len;
+  int i;
+
+  if (entry->dstar)
+    return 0;
+  comp = princ_realm(ctx, entry->pattern, &len);
+  if (!comp || (len == 1 && *comp == '*'))
+    return 0;
+  for (i = 0; i < entry->ncomp; i++) {
+    comp = princ_comp(ctx, entry->pattern, i, &len);
+    if (len == 1 && *comp == '*')
+      return 0;
+  }
+  return 1;
+}
+
+
+static struct ACL *acl_compile(struct rekey_session *sess, char *file,
+                               struct acl_entry *entries)
+{
+  struct ACL *acl;
+  struct acl_entry *entry;
+  struct acl_bucket *b;
+  const char *key, *last;
+  size_t klen, llen;
+  unsigned int slot;
+  int kind;
+
+  acl = malloc(sizeof(struct ACL));
+  if (!acl)
+    fatal("%s: Out of memory\n", file);
+  memset(acl, 0, sizeof(*acl));
+  acl->entries = entries;
+  for (entry = entries; entry; entry = entry->next)
+    entry->seq = acl->nentries++;
+
+  acl->nbuckets = acl->nentries < 8 ? 16 : 2 * acl->nentries;
+  acl->table = calloc(acl->nbuckets, sizeof(struct acl_bucket *));
+  if (!acl->table)
+    fatal("%s: Out of memory\n", file);
+
+  for (entry = entries; entry; entry = entry->next) {
+    entry->ncomp = princ_ncomp(sess->kctx, entry->pattern);
+    if (entry->ncomp > 0) {
+      last = princ_comp(sess->kctx, entry->pattern, entry->ncomp - 1, &llen);
+      entry->dstar = (llen == 2 && !strncmp(last, "**", 2));
+    }
+    if (is_literal(sess->kctx, entry)) {
+      kind = ACL_KEY_LITERAL;
+      key = literal_key(sess->kctx, acl, entry->pattern, entry->ncomp, &klen);
+    } else {
+      kind = entry->dstar ? ACL_KEY_DSTAR : ACL_KEY_FIXED;
+      key = princ_comp(sess->kctx, entry->pattern, 0, &klen);
+    }
+
+    b = acl_bucket(acl, entry->ncomp, kind, key, klen);
+    if (!b) {
+      b = malloc(sizeof(struct acl_bucket));
+      if (!b || !(b->key = malloc(klen + 1)))
+        fatal("%s: Out of memory\n", file);
+      memcpy(b->key, key, klen);
+      b->key[klen] = 0;
+      b->klen = klen;
+      b->ncomp = entry->ncomp;
+      b->kind = kind;
+      b->hash = acl_hash(b->ncomp, b->kind, key, klen);
+      b->head = NULL;
+      b->tail = &b->head;
+      slot = b->hash % acl->nbuckets;
+      b->next = acl->table[slot];
+      acl->table[slot] = b;
+    }
+    *b->tail = entry;
+    b->tail = &entry->chain;
+    if (entry->dstar && entry->ncomp > acl->max_dstar)
+      acl->max_dstar = entry->ncomp;
+  }
+
+  acl->cursor = calloc(4 + 2 * acl->max_dstar, sizeof(struct acl_entry *));
+  if (!acl->cursor)
+    fatal("%s: Out of memory\n", file);
+  return acl;
+}
+
+
+static void free_entries(krb5_context ctx, struct acl_entry *entry)
+{
+  struct acl_entry *next;
+
+  for (; entry; entry = next) {
+    next = entry->next;
+    krb5_free_principal(ctx, entry->pattern);
+    free(entry);
+  }
+}
+
+
+static struct acl_entry *read_entries(struct rekey_session *sess, FILE *F,
+                                      char *file, int *errors)
 {
   char buf[BUFSIZ];
-  struct ACL *acl = NULL, **next = &acl, *entry;
-  FILE *F;
+  struct acl_entry *acl = NULL, **next = &acl, *entry;
   int line = 0;
 
-  F = fopen(file, "r");
-  if (!F)
-    fatal("%s: %s", file, strerror(errno));
-
   while (fgets(buf, sizeof(buf), F)) {
     line++;
-    entry = parse_entry(sess, file, line, buf);
+    entry = parse_entry(sess, file, line, buf, errors);
     if (entry) {
       *next = entry;
       next = &entry->next;
     }
   }
+  return acl;
+}
+
+
+struct ACL *acl_load(struct rekey_session *sess, char *file)
+{
+  struct acl_entry *acl;
+  FILE *F;
+  int errors = 0;
+
+  F = fopen(file, "r");
+  if (!F)
+    fatal("%s: %s", file, strerror(errno));
+
+  acl = read_entries(sess, F, file, &errors);
 
   if (ferror(F))
     fatal("%s: %s", file, strerror(errno));
   fclose(F);
-  return acl;
+  return acl_compile(sess, file, acl);
 }
 
 
 struct ACL *acl_load_builtin(struct rekey_session *sess,
                              char *label, char **text)
 {
-  struct ACL *acl = NULL, **next = &acl, *entry;
-  int line = 0;
+  struct acl_entry *acl = NULL, **next = &acl, *entry;
+  int line = 0, errors = 0;
 
   while (*text) {
     line++;
-    entry = parse_entry(sess, label, line, *text);
+    entry = parse_entry(sess, label, line, *text, &errors);
     if (entry) {
       *next = entry;
       next = &entry->next;
@@ -253,27 +547,235 @@ struct ACL *acl_load_builtin(struct rekey_session *sess,
     text++;
   }
 
-  return acl;
+  return acl_compile(sess, label, acl);
+}
+
+
+static int entry_match(struct rekey_session *sess, struct acl_entry *entry,
+                       krb5_principal subject, int exact)
+{
+  if (exact)
+    return krb5_principal_compare(sess->kctx, subject, entry->pattern);
+  return pattern_match(sess->kctx, sess->realm, subject, entry->pattern);
+}
+
+
+/* Adds the entries in b, if any, to the list of candidates to be walked */
+static void add_candidates(struct ACL *acl, struct acl_bucket *b)
+{
+  if (b)
+    acl->cursor[acl->ncursor++] = b->head;
 }
 
 
 int acl_check(struct rekey_session *sess, struct ACL *acl,
               krb5_principal subject, int exact)
 {
-  int match;
+  struct acl_entry *entry;
+  const char *first, *key;
+  size_t flen, klen;
+  int ncomp, i, pick;
 
   if (krealm_init(sess))
     return 0;
-  while (acl) {
-    if (exact)
-      match = krb5_principal_compare(sess->kctx, subject, acl->pattern);
-    else
-      match = pattern_match(sess->kctx, sess->realm, subject, acl->pattern);
+  if (!acl)
+    return 0;
+
+  ncomp = princ_ncomp(sess->kctx, subject);
+  first = princ_comp(sess->kctx, subject, 0, &flen);
 
-    if (match)
-      return !acl->negative;
+  /*
+   * A subject can always match an entry identical to it.  Otherwise, an
+   * exact match can only be found among entries with the same number of
+   * components and the same first component.  A pattern match can also
+   * come from entries whose first component is "*", or from any entry
+   * ending in "**" which has no more components than the subject.
+   */
+  acl->ncursor = 0;
+  key = literal_key(sess->kctx, acl, subject, ncomp, &klen);
+  if (key)
+    add_candidates(acl, acl_bucket(acl, ncomp, ACL_KEY_LITERAL, key, klen));
+  add_candidates(acl, acl_bucket(acl, ncomp, ACL_KEY_FIXED, first, flen));
+  if (exact) {
+    add_candidates(acl, acl_bucket(acl, ncomp, ACL_KEY_DSTAR, first, flen));
+  } else {
+    add_candidates(acl, acl_bucket(acl, ncomp, ACL_KEY_FIXED, "*", 1));
+    if (ncomp > 0)
+      add_candidates(acl, acl_bucket(acl, 1, ACL_KEY_DSTAR, "**", 2));
+    for (i = 2; i <= ncomp && i <= acl->max_dstar; i++) {
+      add_candidates(acl, acl_bucket(acl, i, ACL_KEY_DSTAR, first, flen));
+      add_candidates(acl, acl_bucket(acl, i, ACL_KEY_DSTAR, "*", 1));
+    }
+  }
 
-    acl = acl->next;
+  /* Walk the candidates in file order, so the first match wins */
+  for (;;) {
+    pick = -1;
+    for (i = 0; i < acl->ncursor; i++) {
+      if (acl->cursor[i] &&
+          (pick < 0 || acl->cursor[i]->seq < acl->cursor[pick]->seq))
+        pick = i;
+    }
+    if (pick < 0)
+      return 0;
+    entry = acl->cursor[pick];
+    if (entry_match(sess, entry, subject, exact))
+      return !entry->negative;
+    acl->cursor[pick] = entry->chain;
+  }
+}
+
+
+/* The straightforward matcher, for comparison with acl_check() */
+int acl_check_linear(struct rekey_session *sess, struct ACL *acl,
+                     krb5_principal subject, int exact)
+{
+  struct acl_entry *entry;
+
+  if (krealm_init(sess))
+    return 0;
+  if (!acl)
+    return 0;
+  for (entry = acl->entries; entry; entry = entry->next) {
+    if (entry_match(sess, entry, subject, exact))
+      return !entry->negative;
   }
   return 0;
 }
+
+
+void acl_free(struct rekey_session *sess, struct ACL *acl)
+{
+  struct acl_bucket *b, *next;
+  unsigned int i;
+
+  if (!acl)
+    return;
+  for (i = 0; i < acl->nbuckets; i++) {
+    for (b = acl->table[i]; b; b = next) {
+      next = b->next;
+      free(b->key);
+      free(b);
+    }
+  }
+  free_entries(sess->kctx, acl->entries);
+  free(acl->table);
+  free(acl->cursor);
+  free(acl->keybuf);
+  free(acl);
+}
+
+
+/*
+ * An ACL file which is loaded once, before any sessions are started, and
+ * reloaded when it changes or when SIGHUP is received.  The file is
+ * checked at most once a second.  If a new version cannot be read or has
+ * errors in it, they are logged and the ACL already loaded is kept.
+ */
+struct acl_file {
+  struct acl_file *next;
+  krb5_context kctx;
+  char *path;
+  struct ACL *acl;
+  struct stat st;
+  time_t checked;
+  int generation;
+};
+
+static struct acl_file *acl_files;
+static volatile sig_atomic_t acl_generation;
+
+void acl_sighup(int sig)
+{
+  acl_generation++;
+}
+
+static void acl_file_read(struct acl_file *af)
+{
+  struct rekey_session tmp;
+  struct acl_entry *entries;
+  struct ACL *old;
+  FILE *F;
+  int errors = 0;
+
+  memset(&tmp, 0, sizeof(tmp));
+  tmp.kctx = af->kctx;
+
+  F = fopen(af->path, "r");
+  if (!F) {
+    prtmsg("%s: %s", af->path, strerror(errno));
+    return;
+  }
+  fstat(fileno(F), &af->st);
+  entries = read_entries(&tmp, F, af->path, &errors);
+  if (ferror(F)) {
+    prtmsg("%s: %s", af->path, strerror(errno));
+    errors++;
+  }
+  fclose(F);
+
+  /* a bad first load is used anyway, as acl_load() would */
+  if (errors && af->acl) {
+    prtmsg("%s: not reloaded due to errors; keeping previous ACL", af->path);
+    free_entries(af->kctx, entries);
+    return;
+  }
+  old = af->acl;
+  af->acl = acl_compile(&tmp, af->path, entries);
+  if (old) {
+    acl_free(&tmp, old);
+    prtmsg("%s: reloaded", af->path);
+  }
+}
+
+struct acl_file *acl_file_load(struct rekey_session *sess, char *path)
+{
+  struct acl_file *af;
+
+  af = malloc(sizeof(struct acl_file));
+  if (!af)
+    fatal("%s: Out of memory\n", path);
+  memset(af, 0, sizeof(*af));
+  af->kctx = sess->kctx;
+  af->path = path;
+  af->generation = acl_generation;
+  af->checked = time(0);
+  acl_file_read(af);
+
+  af->next = acl_files;
+  acl_files = af;
+  return af;
+}
+
+/* Returns the current ACL from af, first reloading it if need be */
+struct ACL *acl_file_current(struct acl_file *af)
+{
+  struct stat st;
+  time_t now;
+
+  if (!af)
+    return NULL;
+  if (af->generation != acl_generation) {
+    af->generation = acl_generation;
+    acl_file_read(af);
+  } else if ((now = time(0)) != af->checked) {
+    af->checked = now;
+    if (!stat(af->path, &st) &&
+        (st.st_dev != af->st.st_dev || st.st_ino != af->st.st_ino ||
+         st.st_size != af->st.st_size || st.st_mtime != af->st.st_mtime)) {
+      af->st = st;
+      acl_file_read(af);
+    }
+  }
+  return af->acl;
+}
+
+/* Brings every loaded ACL file up to date, so that processes forked
+   afterward do not each have to reload it */
+void acl_refresh_all(void)
+{
+  struct acl_file *af;
+
+  for (af = acl_files; af; af = af->next)
+    acl_file_current(af);
+}
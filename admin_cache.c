@@ -0,0 +1,209 @@
+/*
+ * Copyright (c) 2008-2009, 2013 Carnegie Mellon University.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer. 
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * 3. The name "Carnegie Mellon University" must not be used to
+ *    endorse or promote products derived from this software without
+ *    prior written permission. For permission or any other legal
+ *    details, please contact  
+ *      Office of Technology Transfer
+ *      Carnegie Mellon University
+ *      5000 Forbes Avenue
+ *      Pittsburgh, PA  15213-3890
+ *      (412) 268-4387, fax: (412) 268-7395
+ *      tech-transfer@andrew.cmu.edu
+ *
+ * 4. Redistributions of any form whatsoever must retain the following
+ *    acknowledgment:
+ *    "This product includes software developed by Computing Services
+ *     at Carnegie Mellon University (http://www.cmu.edu/computing/)."
+ *
+ * CARNEGIE MELLON UNIVERSITY DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS, IN NO EVENT SHALL CARNEGIE MELLON UNIVERSITY BE LIABLE
+ * FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdarg.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+
+#define SESS_PRIVATE
+#include "rekeysrv-locl.h"
+
+#if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+/* seconds for which an admin check is remembered; 0 disables the cache */
+int admin_cache_ttl = 60;
+int admin_cache_negative_ttl = 15;
+
+#define ADMIN_CACHE_SETS 256
+#define ADMIN_CACHE_WAYS 4
+#define ADMIN_CACHE_NAMELEN 128
+#define ADMIN_CACHE_REPORT 3600
+
+/*
+ * The cache lives in anonymous shared memory set up before any workers
+ * are forked, so an answer found by one process is used by all of them.
+ * There is no lock.  An entry's seq is odd while a process is writing
+ * it; a reader that sees an odd seq, or a different seq after copying
+ * the entry, treats it as a miss.  A writer that cannot claim an entry
+ * simply doesn't store its result.
+ */
+struct admin_cache_entry {
+  volatile unsigned int seq;
+  time_t expires;
+  int result;
+  char name[ADMIN_CACHE_NAMELEN];
+};
+
+struct admin_cache {
+  volatile unsigned long hits;
+  volatile unsigned long misses;
+  volatile time_t last_report;
+  struct admin_cache_entry entries[ADMIN_CACHE_SETS * ADMIN_CACHE_WAYS];
+};
+
+static struct admin_cache *cache;
+
+void admin_cache_init(void) 
+{
+  if (admin_cache_ttl <= 0 && admin_cache_negative_ttl <= 0)
+    return;
+  cache = mmap(NULL, sizeof(struct admin_cache), PROT_READ | PROT_WRITE,
+               MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (cache == MAP_FAILED) {
+    prtmsg("Cannot allocate admin cache: %s", strerror(errno));
+    cache = NULL;
+    return;
+  }
+  memset(cache, 0, sizeof(struct admin_cache));
+  cache->last_report = time(0);
+}
+
+static struct admin_cache_entry *cache_set(const char *name) 
+{
+  unsigned int h = 5381;
+
+  while (*name)
+    h = h * 33 + (unsigned char)*name++;
+  return &cache->entries[(h % ADMIN_CACHE_SETS) * ADMIN_CACHE_WAYS];
+}
+
+/* Returns the cached answer for name, or -1 if there is none */
+static int cache_lookup(const char *name, time_t now) 
+{
+  struct admin_cache_entry *e, copy;
+  unsigned int seq;
+  int i;
+
+  e = cache_set(name);
+  for (i = 0; i < ADMIN_CACHE_WAYS; i++, e++) {
+    seq = e->seq;
+    if (seq & 1)
+      continue;
+    __sync_synchronize();
+    memcpy(&copy, e, sizeof(copy));
+    __sync_synchronize();
+    if (e->seq != seq)
+      continue;
+    copy.name[ADMIN_CACHE_NAMELEN - 1] = 0;
+    if (copy.expires > now && !strcmp(copy.name, name))
+      return copy.result;
+  }
+  return -1;
+}
+
+static void cache_store(const char *name, int result, time_t now) 
+{
+  struct admin_cache_entry *e, *victim;
+  unsigned int seq;
+  int i, ttl;
+
+  ttl = result ? admin_cache_ttl : admin_cache_negative_ttl;
+  if (ttl <= 0)
+    return;
+  /* replace this name's old entry, or else the one expiring soonest */
+  e = victim = cache_set(name);
+  for (i = 0; i < ADMIN_CACHE_WAYS; i++, e++) {
+    if (!strncmp(e->name, name, ADMIN_CACHE_NAMELEN)) {
+      victim = e;
+      break;
+    }
+    if (e->expires < victim->expires)
+      victim = e;
+  }
+  seq = victim->seq;
+  if ((seq & 1) || !__sync_bool_compare_and_swap(&victim->seq, seq, seq + 1))
+    return;
+  victim->expires = now + ttl;
+  victim->result = result;
+  strcpy(victim->name, name);
+  __sync_synchronize();
+  victim->seq = seq + 2;
+}
+
+static void cache_report(time_t now) 
+{
+  time_t last = cache->last_report;
+
+  if (now - last < ADMIN_CACHE_REPORT ||
+      !__sync_bool_compare_and_swap(&cache->last_report, last, now))
+    return;
+  prtmsg("Admin cache: %lu hits, %lu misses", cache->hits, cache->misses);
+}
+
+/*
+ * Check whether sess belongs to an admin, using the cache if possible.
+ * check does the real work.  It returns 1 or 0, or -1 if it could not
+ * find out, in which case the session is not treated as an admin and
+ * nothing is cached.
+ */
+int admin_cache_check(struct rekey_session *sess,
+                      int (*check)(struct rekey_session *)) 
+{
+  time_t now;
+  int ret;
+
+  if (!cache || !sess->plain_name ||
+      strlen(sess->plain_name) >= ADMIN_CACHE_NAMELEN)
+    return check(sess) > 0;
+
+  now = time(0);
+  ret = cache_lookup(sess->plain_name, now);
+  if (ret >= 0) {
+    __sync_fetch_and_add(&cache->hits, 1);
+  } else {
+    __sync_fetch_and_add(&cache->misses, 1);
+    ret = check(sess);
+    if (ret >= 0)
+      cache_store(sess->plain_name, ret, now);
+  }
+  cache_report(now);
+  return ret > 0;
+}
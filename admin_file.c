@@ -43,11 +43,14 @@
 #include "config.h"
 #endif
 #include <stdarg.h>
+#include <string.h>
 
 #define SESS_PRIVATE
 #include "rekeysrv-locl.h"
 
 static char *admin_acl_file = SYSCONFDIR "/rekey.acl";
+/* loaded at startup, and reloaded when it changes */
+static struct acl_file *admin_acl;
 
 char *admin_help_string = "admin ACL file";
 
@@ -57,10 +60,21 @@ void admin_arg(char *arg)
 }
 
 
+void admin_init(void)
+{
+  struct rekey_session tmp;
+
+  memset(&tmp, 0, sizeof(tmp));
+  if (krb5_init_context(&tmp.kctx))
+    fatal("krb5_init_context failed");
+  admin_acl = acl_file_load(&tmp, admin_acl_file);
+}
+
+
 int is_admin(struct rekey_session *sess)
 {
-  if (!sess->admin_data)
-    sess->admin_data = acl_load(sess, admin_acl_file);
+  if (!admin_acl)
+    admin_init();
 
-  return acl_check(sess, sess->admin_data, sess->princ, 1);
+  return acl_check(sess, acl_file_current(admin_acl), sess->princ, 1);
 }
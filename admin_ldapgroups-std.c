@@ -8,6 +8,7 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <time.h>
 #define LDAP_DEPRECATED 1
 #include <ldap.h>
 #include <sasl/sasl.h>
@@ -32,6 +33,11 @@ void admin_arg(char *arg)
 {
   rekey_admin_group = arg;
 }
+
+/* nothing is loaded ahead of time; the directory is consulted as needed */
+void admin_init(void)
+{
+}
 #define LDAP_SET_OPTION(ld,option,invalue) \
   rc=ldap_set_option(ld,option,invalue); \
   if (rc!=LDAP_SUCCESS) \
@@ -76,6 +82,7 @@ static int do_sasl_interact(LDAP *l,unsigned flags,void *defaults,void *_interac
 #endif
 static char *no_attrs[]= {0};
 
+/* returns 1 for exactly one entry, 0 for none, or -1 on error */
 static int verify_single_result(LDAP *l, int always_log, char *reason, LDAPMessage *messages)
 {
   int rc, erc, num_entries;
@@ -85,14 +92,14 @@ static int verify_single_result(LDAP *l, int always_log, char *reason, LDAPMessa
 			 NULL, NULL, 0);
   if (rc != LDAP_SUCCESS) {
     prtmsg("Failed to %s (parse_result): %s", reason, ldap_err2string(rc));
-    return 0;
+    return -1;
   }
   if (erc != LDAP_SUCCESS) {
     prtmsg("Failed to %s (server response): %s%s%s", reason, ldap_err2string(erc),
 	   (errmsg?", ":""), (errmsg?errmsg:""));
     if (errmsg)
       ldap_memfree(errmsg);
-    return 0;
+    return -1;
   }
   if (errmsg)
     ldap_memfree(errmsg);
@@ -104,7 +111,7 @@ static int verify_single_result(LDAP *l, int always_log, char *reason, LDAPMessa
   }
   if (num_entries > 1) {
     prtmsg("Failed to %s (too many entries: %d)", reason, num_entries);
-    return 0;
+    return -1;
   }
   return 1;
 }
@@ -132,38 +139,36 @@ static int verify_op_success(LDAP *l, char *reason, LDAPMessage *messages)
   return 1;
 }
 
-int is_admin(struct rekey_session *sess)
+/*
+ * Configuration, read from the krb5 appdefaults and the password file the
+ * first time it is needed, and the directory connection, which is kept
+ * bound and reused by every later check in this process.
+ */
+static int ldap_configured;
+static char *ldap_url, *ldap_base, *ldap_filter, *ldap_binddn;
+static char *ldap_cacertdir;
+static char ldap_pwbuf[257];
+static LDAP *ldap_conn;
+static time_t ldap_last_used;
+
+/* a connection idle for longer than this may have been dropped by the
+   server or a firewall without our noticing, so open a new one */
+#define LDAP_MAX_IDLE 300
+
+static int ldap_configure(struct rekey_session *sess)
 {
-  static int ldap_initialized=0;
-  char *username=NULL;
-  LDAP *l=NULL;
-  int v, ssl_hard=LDAP_OPT_X_TLS_HARD, rc, ret=0;
-  struct timeval tv;
-  LDAPMessage *response=NULL;
-  char *reason, *filter;
-  char *ldap_url, *ldap_base, *ldap_filter, *ldap_binddn;
-  char *ldap_pwfile, *ldap_cacertdir;
-  char ldap_pwbuf[257];
+  char *ldap_pwfile;
+  int fd, ret=1;
+  ssize_t rsize;
 #ifdef HAVE_KRB5_REALM
   krb5_realm *realm;
 #else
   krb5_data rdata;
   krb5_data *realm = &rdata;
 #endif
-#if !defined(LDAP_OPT_X_TLS_PROTOCOL_MIN)
-  SSL_CTX *sslctx;
-#endif
-
-  if (!princ_ncomp_eq(sess->kctx, sess->princ, 2) ||
-      !compare_princ_comp(sess->kctx, sess->princ, 1, "admin")) {
-    goto freeall;
-  }
-
-  if (!(username=dup_comp_string(sess->kctx, sess->princ, 0))) {
-    prtmsg("Failed to extract username for admin check");
-    goto freeall;
-  }
 
+  if (ldap_configured)
+    return 0;
 #ifdef HAVE_KRB5_REALM
   realm=sess->realm;
 #else
@@ -178,13 +183,13 @@ int is_admin(struct rekey_session *sess)
   krb5_appdefault_string(sess->kctx, "rekey", realm, "ldap_cacertdir", "/etc/andy/ldapcerts", &ldap_cacertdir);
 
   if (strlen(ldap_pwfile) > 0) {
-    int fd=open(ldap_pwfile, O_RDONLY);
-    ssize_t rsize;
+    fd=open(ldap_pwfile, O_RDONLY);
     if (fd < 0) {
       prtmsg("Failed to open LDAP password file %s: %s", ldap_pwfile, strerror(errno));
       goto freeall;
     }
     rsize=read(fd, ldap_pwbuf, 256);
+    close(fd);
     if (rsize < 0) {
       prtmsg("Failed to read from LDAP password file %s: %s", ldap_pwfile, strerror(errno));
       goto freeall;
@@ -197,6 +202,36 @@ int is_admin(struct rekey_session *sess)
       rsize--;
     ldap_pwbuf[rsize]=0;
   }
+  ldap_configured=1;
+  ret=0;
+ freeall:
+  free(ldap_pwfile);
+  return ret;
+}
+
+static void ldap_disconnect(void)
+{
+  if (ldap_conn)
+    ldap_unbind_ext_s(ldap_conn, NULL, NULL);
+  ldap_conn=NULL;
+}
+
+/* Returns the bound connection, opening a new one if there is none or the
+   old one has been idle too long.  Returns NULL on failure. */
+static LDAP *ldap_connection(void)
+{
+  static int ldap_initialized=0;
+  LDAP *l=NULL;
+  int v, ssl_hard=LDAP_OPT_X_TLS_HARD, rc;
+#if !defined(LDAP_OPT_X_TLS_PROTOCOL_MIN)
+  SSL_CTX *sslctx;
+#endif
+
+  if (ldap_conn && time(0) - ldap_last_used > LDAP_MAX_IDLE)
+    ldap_disconnect();
+  if (ldap_conn)
+    return ldap_conn;
+
   if (!ldap_initialized) {
     LDAP_SET_OPTION(NULL, LDAP_OPT_X_TLS_REQUIRE_CERT, &ssl_hard);
     LDAP_SET_OPTION(NULL, LDAP_OPT_X_TLS_CACERTDIR, ldap_cacertdir);
@@ -241,16 +276,67 @@ int is_admin(struct rekey_session *sess)
 #endif
   if (rc!=LDAP_SUCCESS)
   {
-    prtmsg("Failed to connect or authenticate to ldap for %s: %s%s%s", LDAP_URI,
+    prtmsg("Failed to connect or authenticate to ldap for %s: %s%s%s", ldap_url,
 	   ldap_err2string(rc),(errno==0)?"":": ",
 	   (errno==0)?"":strerror(errno));
     goto freeall;
   }
+  ldap_conn=l;
+  l=NULL;
+ freeall:
+  if (l)
+    ldap_unbind_ext_s(l, NULL, NULL);
+  return ldap_conn;
+}
+
+/* errors after which the connection is no use, and a new one may work */
+static int ldap_conn_lost(int rc)
+{
+  return rc == LDAP_SERVER_DOWN || rc == LDAP_CONNECT_ERROR ||
+    rc == LDAP_UNAVAILABLE || rc == LDAP_BUSY || rc == LDAP_TIMEOUT;
+}
+
+/* returns 1 if sess is an admin, 0 if not, or -1 if that can't be
+   determined */
+static int check_ldap(struct rekey_session *sess)
+{
+  char *username=NULL;
+  LDAP *l;
+  int rc=LDAP_SUCCESS, ret=-1, tries;
+  struct timeval tv;
+  LDAPMessage *response=NULL;
+  char *reason, *filter;
+
+  if (!princ_ncomp_eq(sess->kctx, sess->princ, 2) ||
+      !compare_princ_comp(sess->kctx, sess->princ, 1, "admin")) {
+    ret=0;
+    goto freeall;
+  }
+
+  if (!(username=dup_comp_string(sess->kctx, sess->princ, 0))) {
+    prtmsg("Failed to extract username for admin check");
+    goto freeall;
+  }
+
+  if (ldap_configure(sess))
+    goto freeall;
 
   tv.tv_sec=30;
   tv.tv_usec=0;
-  rc = ldap_search_ext_s(l, rekey_admin_group, LDAP_SCOPE_BASE, NO_FILTER,
-			 no_attrs, 0, NULL, NULL, &tv, LDAP_NO_LIMIT, &response);
+  /* the first search also tells us whether a reused connection still
+     works; if it doesn't, try once more on a new one */
+  for (tries = 0; ; tries++) {
+    if (!(l = ldap_connection()))
+      goto freeall;
+    errno=0;
+    rc = ldap_search_ext_s(l, rekey_admin_group, LDAP_SCOPE_BASE, NO_FILTER,
+			   no_attrs, 0, NULL, NULL, &tv, LDAP_NO_LIMIT, &response);
+    if (rc == LDAP_SUCCESS || !ldap_conn_lost(rc) || tries > 0)
+      break;
+    ldap_msgfree(response);
+    response=NULL;
+    ldap_disconnect();
+  }
   if (rc != LDAP_SUCCESS) {
       prtmsg("Failed to verify group %s existence (searching): %s%s%s", rekey_admin_group,
 	   ldap_err2string(rc),(errno==0)?"":": ",
@@ -275,16 +361,20 @@ int is_admin(struct rekey_session *sess)
   }
 
   reason=aasprintf("check user %s admin permission", username);
-  if (!verify_single_result(l, 0, reason, response))
-    goto freeall;
-
-  ret=1;
+  ret=verify_single_result(l, 0, reason, response);
  freeall:
   ldap_msgfree(response);
-  if (l)
-    ldap_unbind_ext_s(l, NULL, NULL);
+  if (ldap_conn) {
+    if (ret < 0 && rc != LDAP_SUCCESS && ldap_conn_lost(rc))
+      ldap_disconnect();
+    else
+      ldap_last_used=time(0);
+  }
   free(username);
   return ret;
 }
 
-  
+int is_admin(struct rekey_session *sess)
+{
+  return admin_cache_check(sess, check_ldap);
+}
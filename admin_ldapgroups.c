@@ -17,14 +17,22 @@ void admin_arg(char *arg)
   rekey_admin_group = arg;
 }
 
-int is_admin(struct rekey_session *sess)
+/* nothing is loaded ahead of time; the directory is consulted as needed */
+void admin_init(void)
+{
+}
+
+/* returns 1 if sess is an admin, 0 if not, or -1 if that can't be
+   determined */
+static int check_groups(struct rekey_session *sess)
 {
   char *username=NULL;
   GROUPS *g=NULL;
-  int rc, ret=0;
+  int rc, ret=-1;
 
   if (!princ_ncomp_eq(sess->kctx, sess->princ, 2) ||
       !compare_princ_comp(sess->kctx, sess->princ, 1, "admin")) {
+    ret = 0;
     goto freeall;
   }
 
@@ -74,3 +82,8 @@ int is_admin(struct rekey_session *sess)
   free(username);
   return ret;
 }
+
+int is_admin(struct rekey_session *sess)
+{
+  return admin_cache_check(sess, check_groups);
+}
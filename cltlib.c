@@ -49,6 +49,7 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netdb.h>
@@ -67,6 +68,7 @@
 #endif
 #include <openssl/ssl.h>
 #include <openssl/err.h>
+#include <openssl/pem.h>
 #ifndef SSL_OP_NO_TICKET
 #define SSL_OP_NO_TICKET 0
 #endif
@@ -78,26 +80,104 @@
 #include "krb5_portability.h"
 
 static SSL_CTX *sslctx;
+/* if set, TLS sessions are saved here and resumed on the next run */
+char *ssl_session_file;
 
 void vprtmsg(const char *msg, va_list ap) {
      vfprintf(stderr, msg, ap);
      fputs("\n", stderr);
 }
 
+#ifdef TLS1_3_VERSION
+/* Save a session ticket sent by the server.  Only TLS 1.3 sessions are
+   kept, since resuming is not safe with finished message bindings. */
+static int save_session(SSL *ssl, SSL_SESSION *sess) {
+  char *tmpname;
+  FILE *f;
+  int fd, rc = 1;
+
+  if (SSL_SESSION_get_protocol_version(sess) < TLS1_3_VERSION)
+    return 0;
+  tmpname = malloc(strlen(ssl_session_file) + 5);
+  if (!tmpname)
+    return 0;
+  sprintf(tmpname, "%s.new", ssl_session_file);
+  fd = open(tmpname, O_WRONLY|O_CREAT|O_TRUNC, 0600);
+  if (fd >= 0) {
+    f = fdopen(fd, "w");
+    if (f) {
+      rc = !PEM_write_SSL_SESSION(f, sess);
+      if (fclose(f))
+        rc = 1;
+    } else {
+      close(fd);
+    }
+  }
+  if (rc == 0 && rename(tmpname, ssl_session_file) == 0) {
+    free(tmpname);
+    return 0;
+  }
+  prtmsg("Cannot save TLS session to %s: %s", ssl_session_file,
+         strerror(errno));
+  unlink(tmpname);
+  free(tmpname);
+  return 0;
+}
+
+static void load_session(SSL *ssl) {
+  SSL_SESSION *sess;
+  FILE *f;
+
+  f = fopen(ssl_session_file, "r");
+  if (!f)
+    return;
+  sess = PEM_read_SSL_SESSION(f, NULL, NULL, NULL);
+  fclose(f);
+  if (!sess) {
+    ERR_clear_error();
+    return;
+  }
+  if (SSL_SESSION_is_resumable(sess))
+    SSL_set_session(ssl, sess);
+  SSL_SESSION_free(sess);
+}
+#endif
+
 void ssl_startup(void) {
   int rc;
      SSL_library_init();
      ERR_load_crypto_strings();
      ERR_load_SSL_strings();
      
-     sslctx=SSL_CTX_new(SSLv23_client_method());
+     sslctx=SSL_CTX_new(TLS_client_method());
      if (!sslctx)
        ssl_fatal(NULL, 0);
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+     /* anonymous suites are refused above security level 0 */
+     rc=SSL_CTX_set_cipher_list(sslctx, "aNULL:-eNULL:-EXPORT:-LOW:-MD5:@STRENGTH:@SECLEVEL=0");
+#else
      rc=SSL_CTX_set_cipher_list(sslctx, "aNULL:-eNULL:-EXPORT:-LOW:-MD5:@STRENGTH");
+#endif
      if (rc == 0)
        ssl_fatal(NULL, 0);
      SSL_CTX_set_options(sslctx, SSL_OP_NO_SSLv2|SSL_OP_NO_SSLv3|SSL_OP_NO_TICKET);
      SSL_CTX_set_session_cache_mode(sslctx, SSL_SESS_CACHE_OFF);
+#ifdef TLS1_3_VERSION
+     /* Ask for TLS 1.3.  The server's certificate is not checked; it is
+        authenticated by GSSAPI, bound to the connection by c_auth(). */
+     {
+       unsigned char alpn[sizeof(REKEY_ALPN)];
+       alpn[0] = sizeof(REKEY_ALPN) - 1;
+       memcpy(alpn + 1, REKEY_ALPN, sizeof(REKEY_ALPN) - 1);
+       if (SSL_CTX_set_alpn_protos(sslctx, alpn, sizeof(alpn)))
+         ssl_fatal(NULL, 0);
+     }
+     if (ssl_session_file) {
+       SSL_CTX_set_session_cache_mode(sslctx, SSL_SESS_CACHE_CLIENT|
+                                      SSL_SESS_CACHE_NO_INTERNAL_STORE);
+       SSL_CTX_sess_set_new_cb(sslctx, save_session);
+     }
+#endif
 
 }
 
@@ -359,6 +439,10 @@ SSL *c_connect(char *hostname) {
      rc=SSL_set_fd(ret, s);
      if (rc == 0)
        ssl_fatal(ret, rc);
+#ifdef TLS1_3_VERSION
+     if (ssl_session_file)
+       load_session(ret);
+#endif
      
      rc=SSL_connect(ret);
      if (rc != 1)
@@ -379,8 +463,6 @@ int sendrcv(SSL *ssl, int opcode, mb_t data) {
 }
 
 void c_auth(SSL *ssl, char *hostname, char *svcname) {
- unsigned char *p;
-     
  OM_uint32 maj, min, rflag;
  gss_name_t n=NULL;
  gss_ctx_id_t gctx=GSS_C_NO_CONTEXT;
@@ -388,7 +470,7 @@ void c_auth(SSL *ssl, char *hostname, char *svcname) {
  gss_buffer_t inp=GSS_C_NO_BUFFER;
  gss_OID_desc reqmech;
  gss_OID mech;
- int gss_more_init=1,gss_more_accept=1, flen;
+ int gss_more_init=1,gss_more_accept=1;
  int resp=0;
  mb_t mic;
  gss_qop_t qop;
@@ -539,27 +621,9 @@ void c_auth(SSL *ssl, char *hostname, char *svcname) {
    fatal("GSSAPI mechanism does not provide data integrity services");
  }
 
- flen = SSL_get_finished(ssl, NULL, 0);
- if (flen == 0) {
+ if (ssl_channel_binding(ssl, 0, 1, &in)) {
    c_close(ssl);
-   fatal("Cannot authenticate: ssl finished message not available");
- }    
- in.length = 2 * flen;
- in.value = malloc(in.length);
- if (in.value == NULL) {
-   c_close(ssl);
-   fatal("Cannot authenticate: memory allocation failed: %s",
-         strerror(errno));
- }
- p=in.value;
- if (flen != SSL_get_finished(ssl, p, flen)) {
-   c_close(ssl);
-   fatal("Cannot authenticate: ssl finished message not available or size changed(!)");
- }    
- p+=flen;
- if (flen != SSL_get_peer_finished(ssl, p, flen)) {
-   c_close(ssl);
-   fatal("Cannot authenticate: ssl finished message not available or size changed(!)");
+   fatal("Cannot authenticate: channel binding data not available");
  }
      
  maj = gss_get_mic(&min, gctx, GSS_C_QOP_DEFAULT, &in, &out);
@@ -591,16 +655,11 @@ void c_auth(SSL *ssl, char *hostname, char *svcname) {
  out.length = mic->length;
  out.value = mic->value;
 
- p=in.value;
- if (flen != SSL_get_peer_finished(ssl, p, flen)) {
-   c_close(ssl);
-   fatal("Cannot authenticate: ssl finished message not available or size changed(!)");
- }    
- p+=flen;
- if (flen != SSL_get_finished(ssl, p, flen)) {
+ free(in.value);
+ if (ssl_channel_binding(ssl, 0, 0, &in)) {
    c_close(ssl);
-   fatal("Cannot authenticate: ssl finished message not available or size changed(!)");
- }    
+   fatal("Cannot authenticate: channel binding data not available");
+ }
  maj = gss_verify_mic(&min, gctx, &in, &out, &qop);
  buf_free(mic);
  if (maj == GSS_S_BAD_SIG) {
@@ -907,37 +966,145 @@ static int process_keys(krb5_context ctx, krb5_keytab kt, mb_t buf,
 }
 
 
+/* When the server takes tagged requests, up to COMMIT_WINDOW commits are
+   sent before waiting for their replies, so that each key need not cost
+   a round trip */
+#define COMMIT_WINDOW 16
+
+struct commit_pipe {
+  SSL *ssl;
+  int tagged;    /* 1 if the server takes tagged requests, -1 if not,
+                    0 if not known yet */
+  int dead;      /* the connection can't be used any more */
+  unsigned int next_id;
+  int n;         /* commits sent and not yet answered */
+  unsigned int ids[COMMIT_WINDOW];
+};
+
+static void commit_reply(struct commit_pipe *p, int resp, mb_t buf) 
+{
+  if (resp == RESP_ERR) {
+    prt_err_reply(buf);
+  } else if (resp == RESP_FATAL) {
+    prt_err_reply(buf);
+    /* this connection is dead (don't send any more messages)*/
+    /* ....but keep processing the keys we received */
+    p->dead = 1;
+  } else if (resp != RESP_OK) {
+    prtmsg("Unexpected reply type %d from server", resp);
+  }
+}
+
+/* Read the reply to an outstanding commit, unwrapping it if it is
+   tagged.  An untagged reply once tagging is known to work means the
+   server has given up on the connection. */
+static int commit_recv(struct commit_pipe *p, mb_t buf) 
+{
+  unsigned int id;
+  unsigned char opc;
+  size_t len;
+  int resp, i;
+
+  resp = do_recv(p->ssl, buf);
+  if (resp == -1) {
+    c_close(p->ssl);
+    fatal("Unexpected server failure: connection closed");
+  }
+  if (resp != RESP_TAGGED) {
+    p->n = 0;
+    if (p->tagged > 0)
+      p->dead = 1;
+    return resp;
+  }
+  p->tagged = 1;
+  reset_cursor(buf);
+  if (buf_getint(buf, &id) || buf_getdata(buf, &opc, 1)) {
+    c_close(p->ssl);
+    fatal("Server sent malformed reply");
+  }
+  for (i = 0; i < p->n && p->ids[i] != id; i++)
+    ;
+  if (i == p->n) {
+    c_close(p->ssl);
+    fatal("Server sent reply to unknown request %u", id);
+  }
+  memmove(&p->ids[i], &p->ids[i + 1], (p->n - i - 1) * sizeof(p->ids[0]));
+  p->n--;
+  len = buf->length - get_cursor(buf);
+  memmove(buf->value, buf->cursor, len);
+  buf_setlength(buf, len);
+  return opc;
+}
+
+static void commit_wait(struct commit_pipe *p, mb_t buf) 
+{
+  int resp;
+
+  resp = commit_recv(p, buf);
+  commit_reply(p, resp, buf);
+}
+
 static int g_complete(void *vctx, char *principal, int kvno) 
 {
-  SSL *ssl = vctx;
-  mb_t commitbuf;
+  struct commit_pipe *p = vctx;
+  mb_t commitbuf, tagbuf;
+  unsigned char opc = OP_COMMITKEY;
+  unsigned int code;
   int resp;
   
+  if (p->dead)
+    return 1;
   commitbuf=buf_alloc(8 + strlen(principal));
-  if (!commitbuf) {
-    c_close(ssl);
+  tagbuf=buf_alloc(13 + strlen(principal));
+  if (!commitbuf || !tagbuf) {
+    c_close(p->ssl);
     fatal("Internal error: Cannot get new buffer: %s", strerror(errno));
   }
 
   if (buf_appendstring(commitbuf, principal) ||
       buf_appendint(commitbuf, kvno)) {
-    c_close(ssl);
+    c_close(p->ssl);
     fatal("Internal error: Cannot append to buffer");
   } 
-  resp = sendrcv(ssl, OP_COMMITKEY, commitbuf);
-  if (resp == RESP_ERR) {
-    prt_err_reply(commitbuf);
-  } else if (resp == RESP_FATAL) {
-    prt_err_reply(commitbuf);
-    /* this connection is dead (don't send any more messages)*/
-    /* ....but keep processing the keys we received */
-    buf_free(commitbuf);
-    return 1;
-  } else if (resp != RESP_OK) {
-    prtmsg("Unexpected reply type %d from server", resp);
+  if (p->tagged < 0) {
+    resp = sendrcv(p->ssl, OP_COMMITKEY, commitbuf);
+    commit_reply(p, resp, commitbuf);
+    goto out;
+  }
+
+  while (p->n == COMMIT_WINDOW && !p->dead)
+    commit_wait(p, tagbuf);
+  if (p->dead)
+    goto out;
+  if (buf_setlength(tagbuf, 0) ||
+      buf_appendint(tagbuf, p->next_id) ||
+      buf_appenddata(tagbuf, &opc, 1) ||
+      buf_appenddata(tagbuf, commitbuf->value, commitbuf->length)) {
+    c_close(p->ssl);
+    fatal("Internal error: Cannot append to buffer");
+  }
+  do_send(p->ssl, OP_TAGGED, tagbuf);
+  p->ids[p->n++] = p->next_id++;
+
+  if (p->tagged == 0) {
+    /* wait for the first reply, to find out whether the server
+       understood the tag */
+    resp = commit_recv(p, tagbuf);
+    if (p->tagged == 0 && resp == RESP_ERR) {
+      reset_cursor(tagbuf);
+      if (buf_getint(tagbuf, &code) == 0 && code == ERR_BADOP) {
+        p->tagged = -1;
+        resp = sendrcv(p->ssl, OP_COMMITKEY, commitbuf);
+        commit_reply(p, resp, commitbuf);
+        goto out;
+      }
+    }
+    commit_reply(p, resp, tagbuf);
   }
+ out:
   buf_free(commitbuf);
-  return 0;
+  buf_free(tagbuf);
+  return p->dead;
 }
 
 
@@ -946,6 +1113,7 @@ void c_getkeys(SSL *ssl, char *keytab, int nprincs, char **princs, int quiet) {
   krb5_keytab kt=NULL;
   mb_t buf;
   int rc, resp, is_error=0, i;
+  struct commit_pipe pipe;
 
   buf=buf_alloc(1);
   if (!buf) {
@@ -990,8 +1158,13 @@ void c_getkeys(SSL *ssl, char *keytab, int nprincs, char **princs, int quiet) {
     goto out;
   }
   is_error = scan_for_bad_keys(ctx, buf);
-  if (is_error == 0)
-    is_error = process_keys(ctx, kt, buf, g_complete, ssl);
+  if (is_error == 0) {
+    memset(&pipe, 0, sizeof(pipe));
+    pipe.ssl = ssl;
+    is_error = process_keys(ctx, kt, buf, g_complete, &pipe);
+    while (pipe.n && !pipe.dead)
+      commit_wait(&pipe, buf);
+  }
   
 
  out:
@@ -1067,6 +1240,76 @@ void c_finalize(SSL *ssl, char *princ) {
   buf_free(buf);
 }
 
+/* Finalize several principals in one request.  Servers which don't
+   support that get a FINALIZE request for each principal instead. */
+void c_finalize_many(SSL *ssl, int n, char **princs) {
+  mb_t buf;
+  unsigned int resp, m, code, i;
+  char *principal=NULL, *msg=NULL;
+  size_t len;
+
+  len = 4;
+  for (i = 0; i < n; i++)
+    len += 4 + strlen(princs[i]);
+  buf = buf_alloc(len);
+  if (!buf) {
+    c_close(ssl);
+    fatal("Memory allocation failed: %s", strerror(errno));
+  } 
+  if (buf_appendint(buf, n)) {
+    c_close(ssl);
+    fatal("Cannot extend buffer: %s", strerror(errno));
+  } 
+  for (i = 0; i < n; i++) {
+    if (buf_appendstring(buf, princs[i])) {
+      c_close(ssl);
+      fatal("Cannot extend buffer: %s", strerror(errno));
+    } 
+  }
+  resp = sendrcv(ssl, OP_FINALIZEMANY, buf);
+  if (resp == RESP_ERR) {
+    reset_cursor(buf);
+    if (buf_getint(buf, &code) == 0 && code == ERR_BADOP) {
+      buf_free(buf);
+      for (i = 0; i < n; i++)
+        c_finalize(ssl, princs[i]);
+      return;
+    }
+    prt_err_reply(buf);
+    goto out;
+  }
+  if (resp == RESP_FATAL) {
+    prt_err_reply(buf);
+    c_close(ssl);
+    exit(1);
+  }
+  if (resp != RESP_RESULTS) {
+    prtmsg("Unexpected reply type %d from server", resp);
+    goto out;
+  }
+  if (buf_getint(buf, &m)) {
+    prtmsg("Server sent malformed reply");
+    goto out;
+  }
+  for (i = 0; i < m; i++) {
+    if (buf_getstring(buf, &principal, malloc) ||
+        buf_getint(buf, &code) ||
+        buf_getstring(buf, &msg, malloc)) {
+      prtmsg("Server sent malformed reply (or memory allocation failed)");
+      goto out;
+    }
+    if (code)
+      prtmsg("%s: %s (error %d)", principal, msg, code);
+    free(principal);
+    free(msg);
+    principal = msg = NULL;
+  }
+ out:
+  free(principal);
+  free(msg);
+  buf_free(buf);
+}
+
 static int count_complete(void *vctx, char *principal, int kvno)
 {
   int *done=vctx;
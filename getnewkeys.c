@@ -79,7 +79,7 @@ int main(int argc, char **argv) {
   int quiet=0;
   
   
-  while ((optch = getopt(argc, argv, "k:r:s:P:ap:q")) != -1) {
+  while ((optch = getopt(argc, argv, "k:r:s:P:S:ap:q")) != -1) {
     switch (optch) {
     case 'k':
       keytab = optarg;
@@ -93,6 +93,9 @@ int main(int argc, char **argv) {
     case 'P':
       princname = optarg;
       break;
+    case 'S':
+      ssl_session_file = optarg;
+      break;
     case 'a':
       allkeys=1;
       break;
@@ -103,7 +106,7 @@ int main(int argc, char **argv) {
       target = optarg;
       break;
     case '?':
-      fprintf(stderr, "Usage: getnewkeys [-q] [-k keytab] [-r realm] [-s hostname] [-P serverprinc]\n [-a] [-p principalname]\n");
+      fprintf(stderr, "Usage: getnewkeys [-q] [-k keytab] [-r realm] [-s hostname] [-P serverprinc]\n [-S sessionfile] [-a] [-p principalname]\n");
       exit(1);
     }
   }
@@ -0,0 +1,276 @@
+/*
+ * Copyright (c) 2008-2009, 2013 Carnegie Mellon University.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer. 
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * 3. The name "Carnegie Mellon University" must not be used to
+ *    endorse or promote products derived from this software without
+ *    prior written permission. For permission or any other legal
+ *    details, please contact  
+ *      Office of Technology Transfer
+ *      Carnegie Mellon University
+ *      5000 Forbes Avenue
+ *      Pittsburgh, PA  15213-3890
+ *      (412) 268-4387, fax: (412) 268-7395
+ *      tech-transfer@andrew.cmu.edu
+ *
+ * 4. Redistributions of any form whatsoever must retain the following
+ *    acknowledgment:
+ *    "This product includes software developed by Computing Services
+ *     at Carnegie Mellon University (http://www.cmu.edu/computing/)."
+ *
+ * CARNEGIE MELLON UNIVERSITY DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS, IN NO EVENT SHALL CARNEGIE MELLON UNIVERSITY BE LIABLE
+ * FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdarg.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/mman.h>
+
+#define SESS_PRIVATE
+#include "rekeysrv-locl.h"
+
+#if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+/* kadmin operations started per second, and how many may start at once
+   after a quiet spell; 0 means no rate limit */
+int kadm_rate = 0;
+int kadm_burst = 1;
+/* kadmin operations in progress at once; 0 means no limit.  The last
+   kadm_admin_reserve of them are only used by administrators */
+int kadm_max_ops = 0;
+int kadm_admin_reserve = 0;
+/* seconds a caller queues before giving up, for others and for admins */
+int kadm_max_wait = 30;
+int kadm_admin_max_wait = 120;
+
+#define KADM_LIMIT_POLL 20
+#define KADM_LIMIT_REPORT 3600
+
+/*
+ * The limiter lives in anonymous shared memory set up before any workers
+ * are forked, so it covers every process serving sessions.  As with the
+ * admin cache, there is no lock.  The rate is kept as the time at which
+ * the next operation may start without using up the burst allowance
+ * (the "theoretical arrival time"); a caller reserves its turn by moving
+ * that forward, then sleeps until its turn comes.  Each concurrency slot
+ * holds the pid of the process using it, so a slot held by a process
+ * which died is taken back.
+ */
+struct kadm_limit {
+  volatile long long next;
+  volatile int waiting[2];
+  volatile int max_waiting;
+  volatile unsigned long ops;
+  volatile unsigned long delayed;
+  volatile unsigned long refused;
+  volatile unsigned long wait_ms;
+  volatile time_t last_report;
+  volatile pid_t slots[1];
+};
+
+static struct kadm_limit *limit;
+
+void kadm_limit_init(void) 
+{
+  size_t len;
+
+  if (kadm_rate <= 0 && kadm_max_ops <= 0)
+    return;
+  len = sizeof(struct kadm_limit) +
+    (kadm_max_ops > 0 ? kadm_max_ops : 1) * sizeof(pid_t);
+  limit = mmap(NULL, len, PROT_READ | PROT_WRITE,
+               MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (limit == MAP_FAILED) {
+    prtmsg("Cannot allocate kadmin limiter: %s", strerror(errno));
+    limit = NULL;
+    return;
+  }
+  memset(limit, 0, len);
+  limit->last_report = time(0);
+}
+
+static long long now_usec(void) 
+{
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+  return (long long)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+/* Reserve the next start time allowed by the rate limit, unless it is
+   after deadline.  Returns the time reserved, or 0 */
+static long long take_token(long long now, long long deadline) 
+{
+  long long next, tat, turn, interval, burst;
+
+  interval = 1000000 / kadm_rate;
+  burst = (long long)(kadm_burst - 1) * interval;
+  do {
+    next = limit->next;
+    tat = next > now ? next : now;
+    turn = tat - burst;
+    if (turn > deadline)
+      return 0;
+  } while (!__sync_bool_compare_and_swap(&limit->next, next, tat + interval));
+  return turn > now ? turn : now;
+}
+
+/* Claim a free concurrency slot, returning its index + 1, or 0 */
+static int take_slot(int admin) 
+{
+  pid_t pid, self = getpid();
+  int i, n;
+
+  n = kadm_max_ops;
+  if (!admin) {
+    if (limit->waiting[1])
+      return 0;
+    n -= kadm_admin_reserve;
+  }
+  for (i = 0; i < n; i++) {
+    pid = limit->slots[i];
+    if (pid && pid != self && kill(pid, 0) < 0 && errno == ESRCH &&
+        __sync_bool_compare_and_swap(&limit->slots[i], pid, 0)) {
+      prtmsg("Reclaimed kadmin slot held by exited process %d", (int)pid);
+      pid = 0;
+    }
+    if (!pid && __sync_bool_compare_and_swap(&limit->slots[i], 0, self))
+      return i + 1;
+  }
+  return 0;
+}
+
+static void limit_report(time_t now) 
+{
+  time_t last = limit->last_report;
+
+  if (now - last < KADM_LIMIT_REPORT ||
+      !__sync_bool_compare_and_swap(&limit->last_report, last, now))
+    return;
+  prtmsg("kadmin limiter: %lu operations, %lu delayed for %lu ms in all, "
+         "%lu refused; %d waiting now, at most %d",
+         limit->ops, limit->delayed, limit->wait_ms, limit->refused,
+         limit->waiting[0] + limit->waiting[1], limit->max_waiting);
+}
+
+/*
+ * Wait until sess may start another kadmin operation: one more start
+ * must fit in the rate limit, and the session must hold a concurrency
+ * slot, which it keeps until kadm_limit_leave().  Administrators may use
+ * the reserved slots, and others do not take a slot while an
+ * administrator is waiting for one.  Returns nonzero if the caller
+ * would have had to wait longer than its class's limit.
+ */
+int kadm_limit_enter(struct rekey_session *sess) 
+{
+  long long start, now, deadline, turn;
+  int admin = sess->is_admin ? 1 : 0;
+  int depth, queued = 0, slot_taken = 0, ret = 1;
+  long waited;
+
+  if (!limit)
+    return 0;
+  start = now = now_usec();
+  /* in the event loop a wait would stall every other connection, so
+     only take a token or slot that is free right now */
+  if (event_mode)
+    deadline = now;
+  else
+    deadline = now +
+      (long long)(admin ? kadm_admin_max_wait : kadm_max_wait) * 1000000;
+
+  /* The slot comes first: a rate token, once taken, delays everyone
+     after it, so it is only taken by a caller sure to go ahead */
+  if (kadm_max_ops > 0 && !sess->kadm_slot) {
+    while (!(sess->kadm_slot = take_slot(admin))) {
+      if (now >= deadline)
+        goto done;
+      if (!queued) {
+        depth = __sync_add_and_fetch(&limit->waiting[admin], 1);
+        queued = 1;
+        if (depth > limit->max_waiting)
+          limit->max_waiting = depth;
+      }
+      poll(NULL, 0, KADM_LIMIT_POLL);
+      now = now_usec();
+    }
+    slot_taken = 1;
+  }
+  if (kadm_rate > 0) {
+    turn = take_token(now, deadline);
+    if (!turn) {
+      if (slot_taken)
+        kadm_limit_leave(sess);
+      goto done;
+    }
+    if (turn > now) {
+      if (!queued) {
+        depth = __sync_add_and_fetch(&limit->waiting[admin], 1);
+        queued = 1;
+        if (depth > limit->max_waiting)
+          limit->max_waiting = depth;
+      }
+      poll(NULL, 0, (int)((turn - now + 999) / 1000));
+      now = now_usec();
+    }
+  }
+  ret = 0;
+ done:
+  if (queued)
+    __sync_sub_and_fetch(&limit->waiting[admin], 1);
+  waited = (long)((now - start) / 1000);
+  if (ret) {
+    __sync_fetch_and_add(&limit->refused, 1);
+    prtmsg("Too busy to start a kadmin operation for %s",
+           sess->plain_name ? sess->plain_name : "unknown client");
+  } else {
+    __sync_fetch_and_add(&limit->ops, 1);
+  }
+  if (waited > 0) {
+    __sync_fetch_and_add(&limit->delayed, 1);
+    __sync_fetch_and_add(&limit->wait_ms, waited);
+    sess->kadm_wait += waited;
+  }
+  limit_report(time(0));
+  return ret;
+}
+
+/* Give up the session's concurrency slot, if it holds one */
+void kadm_limit_leave(struct rekey_session *sess) 
+{
+  if (!limit || !sess->kadm_slot)
+    return;
+  limit->slots[sess->kadm_slot - 1] = 0;
+  sess->kadm_slot = 0;
+}
@@ -69,24 +69,25 @@ struct mem_buffer_storage {
 static struct mem_buffer_storage *head;
 
 int adjust_mem_buffer_int(struct mem_buffer_storage *buffer, size_t size) {
-  void *new;
-  size_t new_size = 64 * ((size + 63) / 64);
+  char *new, *old;
+  size_t new_size = 64 * ((size + BUF_HEADROOM + 63) / 64);
   
   if (size < buffer->buffer.allocated)
     return 0;
-  if (buffer->buffer.value == buffer->initial_storage) {
+  old = (char *)buffer->buffer.value - BUF_HEADROOM;
+  if (old == buffer->initial_storage) {
     new = malloc(new_size);
     if (new && 
 	buffer->buffer.length && 
 	buffer->buffer.length < buffer->buffer.allocated)
-      memcpy(new, buffer->initial_storage, buffer->buffer.length);
+      memcpy(new + BUF_HEADROOM, buffer->buffer.value, buffer->buffer.length);
   } else {
-    new = realloc(buffer->buffer.value, new_size);
+    new = realloc(old, new_size);
   }
   if (new == NULL) 
     return 1;
-  buffer->buffer.value = new;
-  buffer->buffer.allocated = new_size;
+  buffer->buffer.value = new + BUF_HEADROOM;
+  buffer->buffer.allocated = new_size - BUF_HEADROOM;
   return 0;
 }
 
@@ -94,9 +95,6 @@ struct mem_buffer *buf_alloc(size_t size) {
   struct mem_buffer_storage *cur, *prev;
   int i;
 
-  if (size == 0)
-    return (struct mem_buffer *)calloc(1, sizeof(struct mem_buffer));
-
   for (i=0;i <= 1; i++) {
     for (cur=head,prev=NULL;cur;prev=cur,cur=cur->next) {
       if (cur->buffer.allocated >= size)
@@ -123,8 +121,8 @@ struct mem_buffer *buf_alloc(size_t size) {
   cur=calloc(1, sizeof(struct mem_buffer_storage));
   if (!cur)
     return NULL;
-  cur->buffer.value = cur->initial_storage;
-  cur->buffer.allocated = sizeof(cur->initial_storage);
+  cur->buffer.value = cur->initial_storage + BUF_HEADROOM;
+  cur->buffer.allocated = sizeof(cur->initial_storage) - BUF_HEADROOM;
   cur->buffer.cursor = NULL;
   if (adjust_mem_buffer_int(cur, size)) {
     free(cur);
@@ -137,10 +135,6 @@ void buf_free(struct mem_buffer *buffer) {
   struct mem_buffer_storage *internal;
 
   buffer->length = 0;
-  if (buffer->allocated == 0) {
-    free(buffer);
-    return;
-  }
   internal = (struct mem_buffer_storage *)buffer;
   internal->next = head;
   head = internal;
@@ -49,6 +49,10 @@ typedef struct mem_buffer {
    size_t allocated;
 } *mb_t;
 
+/* Every buffer has this many bytes reserved in front of value, so that a
+   protocol header can be put in front of the data without copying it. */
+#define BUF_HEADROOM 8
+
 struct mem_buffer *buf_alloc(size_t);
 void buf_free(struct mem_buffer *);
 int buf_grow(struct mem_buffer *, size_t);
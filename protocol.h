@@ -63,8 +63,17 @@
    N bytes of local finished message
    4 bytes of remote finished message length
    N bytes of remote finished message
+   or, if TLS 1.3 was negotiated:
+   32 bytes of tls-exporter channel binding (RFC 9266)
+   1 byte, 'C'
 */
 
+/* TLS 1.3 is only negotiated with clients that offer this ALPN protocol,
+   since older clients always bind to the finished messages */
+#define REKEY_ALPN "rekey-tls13"
+#define CB_EXPORTER_LABEL "EXPORTER-Channel-Binding"
+#define CB_EXPORTER_LEN 32
+
 /* start a new rekey for a shared principal */
 /* requires admin authorization */
 #define OP_NEWREQ 4
@@ -137,7 +146,34 @@
   N bytes of principal name
 */
 
-#define MAX_OPCODE OP_DELPRINC
+/* finalize (complete) several in-progress rekeys */
+/* each requires admin or target authorization */
+#define OP_FINALIZEMANY 12
+/* data is a list of principal names
+   4 bytes of principal count {
+     4 bytes of principal name length
+     N bytes of principal name
+   }
+*/
+
+/* carry another request, tagged with an ID chosen by the client, so that
+   several requests may be outstanding at once */
+/* not allowed before authentication is complete, and may not carry
+   OP_AUTH, OP_AUTHERR, OP_AUTHCHAN or another OP_TAGGED */
+#define OP_TAGGED 13
+/* data is request ID, opcode, and the request's own data
+   4 bytes of request ID
+   1 byte of opcode
+   N bytes of request data (the rest of the message)
+*/
+/* The reply is RESP_TAGGED, carrying the same ID.  Replies are sent in
+   the order the requests arrived, but clients should match them by ID.
+   A server which does not know OP_TAGGED answers with an untagged
+   RESP_ERR (ERR_BADOP), without performing the request, so a client
+   must not send a second tagged request until it has seen a RESP_TAGGED
+   reply to the first. */
+
+#define MAX_OPCODE OP_TAGGED
 
 #define RESP_AUTH 128
 /* data is flags, gss context token
@@ -153,6 +189,9 @@
    N bytes of local finished message
    4 bytes of remote finished message length
    N bytes of remote finished message
+   or, if TLS 1.3 was negotiated:
+   32 bytes of tls-exporter channel binding (RFC 9266)
+   1 byte, 'S'
 */
 #define RESP_ERR 131
 /* data is error code, error string 
@@ -192,11 +231,29 @@
        N bytes of key
      }
    }
+*/
+#define RESP_RESULTS 136
+/* data is the outcome of the operation on each principal
+   4 bytes of principal count {
+     4 bytes of principal name length
+     N bytes of principal name
+     4 bytes of error code (0 on success)
+     4 bytes of error string length
+     N bytes of error string
+   }
+*/
+#define RESP_TAGGED 137
+/* data is request ID, response type, and the response's own data
+   4 bytes of request ID
+   1 byte of response type
+   N bytes of response data (the rest of the message)
 */
    /* COMMITKEY returns RESP_OK on success */
    /* SIMPLEKEY returns RESP_KEYS on success */
    /* ABORTREQ returns RESP_OK on success */
    /* FINALIZE returns RESP_OK on success */
+   /* FINALIZEMANY returns RESP_RESULTS */
+   /* TAGGED returns RESP_TAGGED, wrapping the reply to the request */
 
 
    /* more auth packets are expected */
@@ -229,5 +286,7 @@
 #define ERR_NOTFOUND 6
    /* Other/unknown error */
 #define ERR_OTHER 7
+   /* server is overloaded; the message says when to retry */
+#define ERR_BUSY 8
 
 #endif
@@ -43,8 +43,19 @@
 
 struct mem_buffer;
 
+/* default limit on the size of a received message */
+#define REKEY_MAX_FRAME (4 * 1024 * 1024)
+extern unsigned int max_frame_size;
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+#define TLS_server_method SSLv23_server_method
+#define TLS_client_method SSLv23_client_method
+#endif
+
 void do_send(SSL *, int, struct mem_buffer *);
+int frame_append(struct mem_buffer *, int, struct mem_buffer *);
 int do_recv(SSL *, struct mem_buffer *);
+int ssl_channel_binding(SSL *, int, int, gss_buffer_t);
 void prt_gss_error(gss_OID, OM_uint32, OM_uint32);
 void do_gss_error(gss_OID, OM_uint32, OM_uint32, void (*)(void *, gss_buffer_t), void *);
 void prt_err_reply(struct mem_buffer *);
@@ -67,6 +78,8 @@ void ssl_fatal(SSL *, int)
 #endif
   ;
 
+extern void (*fatal_hook)(void);
+
 /* provided independently by client & server */
 void vprtmsg(const char *, va_list ap);
 
@@ -1,6 +1,8 @@
 #ifndef _CLT_LOCL_H
 #define _CLT_LOCL_H
 
+extern char *ssl_session_file;
+
 void ssl_startup(void);
 void ssl_cleanup(void);
 char *get_server(char *);
@@ -11,6 +13,7 @@ void c_auth(SSL *, char *, char *);
 void c_newreq(SSL *, char *, int, int, char **);
 void c_status(SSL *, char *);
 void c_finalize(SSL *, char *);
+void c_finalize_many(SSL *, int, char **);
 void c_delprinc(SSL *, char *);
 void c_simplekey(SSL *, char *, int, char *);
 void c_getkeys(SSL *, char *, int, char **, int);
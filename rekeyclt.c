@@ -111,7 +111,7 @@ int main(int argc, char **argv) {
     fprintf(stderr, "       rekeyclt start principalname hostname [hostname]...\n");
     fprintf(stderr, "       rekeyclt status principalname\n");
     fprintf(stderr, "       rekeyclt abort principalname\n");
-    fprintf(stderr, "       rekeyclt finalize principalname\n");
+    fprintf(stderr, "       rekeyclt finalize principalname [principalname]...\n");
     fprintf(stderr, "       rekeyclt key principalname\n");
     exit(1);
   }
@@ -141,7 +141,10 @@ int main(int argc, char **argv) {
   } else if (!strcmp(cmd, "abort")) {
     c_abort(conn, targetname);
   } else if (!strcmp(cmd, "finalize")) {
-    c_finalize(conn, targetname);
+    if (argc > optind)
+      c_finalize_many(conn, argc - optind + 1, argv + optind - 1);
+    else
+      c_finalize(conn, targetname);
   } else if (!strcmp(cmd, "delprinc")) {
     c_delprinc(conn, targetname);
   } else if (!strcmp(cmd, "key")) {
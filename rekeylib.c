@@ -66,12 +66,20 @@
 
 #include "memmgt.h"
 #include "rekey-locl.h"
+#include "protocol.h"
+
+/* If set, fatal() and ssl_fatal() call this instead of exiting.  It must
+   not return.  Used by servers that multiplex many sessions in one
+   process, where an error on one connection should not kill the others. */
+void (*fatal_hook)(void);
 
 void fatal(const char *msg, ...) {
      va_list ap;
      va_start(ap, msg);
      vprtmsg( msg, ap);
      va_end(ap);
+     if (fatal_hook)
+       fatal_hook();
      exit(1);
 }
 
@@ -119,6 +127,8 @@ void ssl_fatal(SSL *ssl, int code) {
     if (code2 == SSL_ERROR_SYSCALL) {
       if (errno == 0)
         prtmsg("Connection closed");
+      else if (errno == EAGAIN || errno == EWOULDBLOCK)
+        prtmsg("Connection timed out");
       else
         prtmsg("SSL failed due to i/o error: %s", strerror(errno));
     } else {
@@ -128,72 +138,147 @@ void ssl_fatal(SSL *ssl, int code) {
   } else {
     prtmsg("SSL failed, but no information is available (code = %d)", code);
   }
+  if (fatal_hook)
+    fatal_hook();
   exit(1);
 }
 
-void do_send(SSL *ssl, int opcode, mb_t data) {
-  mb_t actual;
-  struct mem_buffer empty;
-  int rc;
+/* Append a framed message (opcode, length, data) to out. Returns non-zero
+   if memory could not be allocated */
+int frame_append(mb_t out, int opcode, mb_t data) {
   unsigned char opc;
 
-  if (!data) {
-    empty.length=0;
-    data = &empty;
-  }
-  actual = buf_alloc(5 + data->length);
-  if (!actual) 
-    fatal("memory allocation failed: %s", strerror(errno));
-  buf_setlength(actual, 5 + data->length);
   opc = opcode & 0xFF;
-  if (buf_putdata(actual, &opc, 1))
-    fatal("Impossible error. buffer too small!");
-  if (buf_putint(actual, data->length))
-    fatal("Impossible error. buffer too small!");
-  if (data->length)
-    buf_putdata(actual, data->value, data->length);
-  rc = SSL_write(ssl, actual->value, actual->length);
-  if (rc < 0)
-    ssl_fatal(ssl, rc);
-  else if (rc == 0)
-    fatal("Connection closed");
-  else if (rc !=  5 + data->length)
-    fatal("Short write");
-  buf_free(actual);
+  if (buf_appenddata(out, &opc, 1) ||
+      buf_appendint(out, data ? data->length : 0))
+    return 1;
+  if (data && data->length)
+    return buf_appenddata(out, data->value, data->length);
+  return 0;
+}
+
+/* Largest message do_recv() will accept; the length field comes from the
+   peer, so it must not be trusted to size an allocation. */
+unsigned int max_frame_size = REKEY_MAX_FRAME;
+
+static void ssl_write_all(SSL *ssl, const unsigned char *p, size_t len) {
+  int rc;
+
+  while (len > 0) {
+    rc = SSL_write(ssl, p, len > INT_MAX ? INT_MAX : len);
+    if (rc < 0)
+      ssl_fatal(ssl, rc);
+    else if (rc == 0)
+      fatal("Connection closed");
+    p += rc;
+    len -= rc;
+  }
+}
+
+/* Returns 1 if the connection was closed before anything was read */
+static int ssl_read_all(SSL *ssl, unsigned char *p, size_t len) {
+  size_t done = 0;
+  int rc;
+
+  while (done < len) {
+    rc = SSL_read(ssl, p + done,
+                  len - done > INT_MAX ? INT_MAX : len - done);
+    if (rc < 0)
+      ssl_fatal(ssl, rc);
+    else if (rc == 0) {
+      if (done == 0)
+        return 1;
+      fatal("Short read");
+    }
+    done += rc;
+  }
+  return 0;
+}
+
+/* The header is built in the buffer's headroom, so the message goes out
+   in one write without copying the data. */
+void do_send(SSL *ssl, int opcode, mb_t data) {
+  unsigned char hdr[5], *p;
+  size_t len;
+
+  len = data ? data->length : 0;
+  if (len > 0xFFFFFFFFUL)
+    fatal("Message too large to send (%lu bytes)", (unsigned long)len);
+  p = (data && data->value) ? (unsigned char *)data->value - 5 : hdr;
+  p[0] = opcode & 0xFF;
+  p[1] = (len >> 24) & 0xFF;
+  p[2] = (len >> 16) & 0xFF;
+  p[3] = (len >> 8) & 0xFF;
+  p[4] = len & 0xFF;
+  ssl_write_all(ssl, p, len + 5);
 }
 
 int do_recv(SSL *ssl, mb_t data) {
-  unsigned char opc;
-  int rc, opcode;
+  unsigned char hdr[5];
   unsigned int rlen;
   
-  if (buf_setlength(data, 5))
-    fatal("memory allocation failed: %s", strerror(errno));
-  rc = SSL_read(ssl, data->value, 5);
-  if (rc < 0)
-    ssl_fatal(ssl, rc);
-  else if (rc == 0) {
+  if (ssl_read_all(ssl, hdr, 5))
     return -1;
-    /*fatal("Connection closed");*/
-  } else if (rc != 5)
-    fatal("Short read");
-  if (buf_getdata(data, &opc, 1))
-    fatal("Impossible error. buffer too small!");
-  opcode = opc;
-  if (buf_getint(data, &rlen))
-    fatal("Impossible error. buffer too small!");
+  rlen = ((unsigned int)hdr[1] << 24) | (hdr[2] << 16) | (hdr[3] << 8) |
+    hdr[4];
+  if (rlen > max_frame_size)
+    fatal("Message too large (%u bytes)", rlen);
   if (buf_setlength(data, rlen))
       fatal("memory allocation failed: %s", strerror(errno));
-  if (rlen > 0) {
-      rc = SSL_read(ssl, data->value, rlen);
-      if (rc < 0)
-        ssl_fatal(ssl, rc);
-      else if (rc == 0)
-        fatal("Connection closed");
-      else if (rc != rlen)
-        fatal("Short read");
+  if (rlen > 0 && ssl_read_all(ssl, data->value, rlen))
+    fatal("Connection closed");
+  return hdr[0];
+}
+
+/* Get the data MICed in the AUTHCHAN exchange.  from_client selects the
+   client's message rather than the server's reply.  With TLS 1.3 this is
+   the tls-exporter value followed by a byte naming the sender; earlier
+   versions use the sender's finished message followed by the peer's.
+   The caller frees cb->value.  Returns non-zero if the data is not
+   available. */
+int ssl_channel_binding(SSL *ssl, int is_server, int from_client,
+                        gss_buffer_t cb) {
+  unsigned char *p;
+  size_t flen;
+
+#ifdef TLS1_3_VERSION
+  if (SSL_version(ssl) >= TLS1_3_VERSION) {
+    cb->length = CB_EXPORTER_LEN + 1;
+    cb->value = p = malloc(cb->length);
+    if (p == NULL)
+      return 1;
+    if (SSL_export_keying_material(ssl, p, CB_EXPORTER_LEN,
+                                   CB_EXPORTER_LABEL,
+                                   strlen(CB_EXPORTER_LABEL),
+                                   NULL, 0, 0) != 1) {
+      free(p);
+      return 1;
+    }
+    p[CB_EXPORTER_LEN] = from_client ? 'C' : 'S';
+    return 0;
   }
-  return opcode == -1 ? -2 : opcode;
+#endif
+  flen = SSL_get_finished(ssl, NULL, 0);
+  if (flen == 0)
+    return 1;
+  cb->length = 2 * flen;
+  cb->value = p = malloc(cb->length);
+  if (p == NULL)
+    return 1;
+  /* the sender's finished message comes first */
+  if (!is_server == !from_client) {
+    if (flen != SSL_get_finished(ssl, p, flen) ||
+        flen != SSL_get_peer_finished(ssl, p + flen, flen))
+      goto fail;
+  } else {
+    if (flen != SSL_get_peer_finished(ssl, p, flen) ||
+        flen != SSL_get_finished(ssl, p + flen, flen))
+      goto fail;
+  }
+  return 0;
+ fail:
+  free(p);
+  return 1;
 }
 
 void do_gss_error(gss_OID mech, OM_uint32 errmaj, OM_uint32 errmin,
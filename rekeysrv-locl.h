@@ -60,6 +60,9 @@ void ssl_fatal(SSL *, int)
 #endif
 ;
 SSL *do_ssl_accept(int s);
+SSL *ssl_new_conn(int s);
+struct rekey_session;
+void sess_init(struct rekey_session *, SSL *);
 #ifndef SSL_OP_NO_TICKET
 #define SSL_OP_NO_TICKET 0
 #endif
@@ -70,6 +73,9 @@ SSL *do_ssl_accept(int s);
 #if SQLITE_VERSION_NUMBER < 3005000
 #define sqlite3_prepare_v2 sqlite3_prepare
 #endif
+struct rekey_session;
+int sql_log_download(struct rekey_session *, sqlite_int64, sqlite_int64,
+                     krb5_kvno);
 #endif
 
 #ifdef SESS_PRIVATE
@@ -78,7 +84,6 @@ struct rekey_session {
   int state;
   SSL *ssl;
   krb5_context kctx;
-  struct ACL *target_acl;
   gss_ctx_id_t gctx;
   gss_OID mech;
   gss_name_t name;
@@ -86,13 +91,27 @@ struct rekey_session {
   char *hostname;
   krb5_principal princ;
   int authstate;
+  int tagged;
+  unsigned int tag;
   int is_admin;
   int is_host;
-  int db_lock;
+  int db_trans;
+  long db_wait;
   sqlite3 *dbh;
   char *realm;
   void *kadm_handle;
+  int kadm_calls;
+  long kadm_time;
+  int kadm_slot;
+  long kadm_wait;
+  /* the kdc entry seen by the last setup_principal, for do_finalize_req */
+  sqlite_int64 setup_princid;
+  char *setup_name;
+  krb5_kvno setup_kvno;
+  krb5_flags setup_attributes;
+  time_t setup_time;
   void *admin_data;
+  struct mem_buffer *outq;
 };
 #define REKEY_SESSION_LISTENING 0
 #define REKEY_SESSION_SENDING 1
@@ -104,23 +123,64 @@ struct rekey_session;
 #define REKEY_TARGET_ACL SYSCONFDIR "/rekey.targets"
 #define REKEY_LOCAL_DATABASE "/var/heimdal/rekeys"
 #define REKEY_DATABASE_LOCK "/var/heimdal/rekeys.lock"
+#define REKEY_DOWNLOAD_JOURNAL "/var/heimdal/rekeys.downloads"
 
 struct gss_OID_desc_struct;
 struct gss_buffer_desc_struct;
 struct sockaddr;
 struct mem_buffer;
 struct ACL;
+struct acl_file;
+struct sqlite3_stmt;
 
 extern char *admin_help_string;
 extern char *target_acl_path;
 extern int force_compat_enctype;
+extern int handshake_timeout;
+extern int request_timeout;
+extern int idle_timeout;
 extern krb5_enctype *cfg_enctypes;
+extern int pool_min_workers;
+extern int pool_max_workers;
+extern int pool_max_requests;
+extern int event_mode;
+extern int max_sessions;
+extern int max_pending;
+extern int busy_retry;
+extern char *listen_port;
+extern int listen_backlog;
+extern int listen_reuseport;
+extern int ticket_lifetime;
+extern unsigned int max_frame_size;
+extern int admin_cache_ttl;
+extern int admin_cache_negative_ttl;
+extern int download_journal_count;
+extern int download_journal_age;
+extern int kadm_handle_lifetime;
+extern int kadm_rate;
+extern int kadm_burst;
+extern int kadm_max_ops;
+extern int kadm_admin_reserve;
+extern int kadm_max_wait;
+extern int kadm_admin_max_wait;
 
 void child_cleanup(void) ;
 void ssl_startup(void);
 void ssl_cleanup(void);
+int ssl_set_groups(char *);
+void ssl_benchmark(int);
 void net_startup(void);
 void run_session(int);
+void serve_session(int);
+void log_connection(struct sockaddr *);
+void run_one(int, struct sockaddr *);
+void admission_init(void);
+int admission_tick(void);
+int pool_sessions(int, int, int *);
+void run_worker_pool(void);
+void run_event_loop(int (*)(void));
+void sess_startup(void);
+void sess_dispatch(struct rekey_session *, int, struct mem_buffer *);
 void sess_finalize(struct rekey_session *);
 void sess_send(struct rekey_session *, int, struct mem_buffer *);
 int sess_recv(struct rekey_session *, struct mem_buffer *);
@@ -129,18 +189,42 @@ void send_fatal(struct rekey_session *, int errcode, char *msg);
 void send_gss_error(struct rekey_session *, struct gss_OID_desc_struct *,
     int, int);
 void send_gss_token(struct rekey_session *, int, int, struct gss_buffer_desc_struct *);
-int run_accept_loop(void (*)(int , struct sockaddr *));
+int run_accept_loop(void (*)(int , struct sockaddr *), int (*)(void));
+int net_accept(struct sockaddr *, int);
+int net_listeners(int **);
+void set_io_deadline(int, int, const char *);
+int sql_startup(void);
 int sql_init(struct rekey_session *);
+void sql_release(struct rekey_session *);
 int sql_begin_trans(struct rekey_session *);
 int sql_commit_trans(struct rekey_session *);
 int sql_rollback_trans(struct rekey_session *);
+int sql_prepare(struct rekey_session *, const char *, struct sqlite3_stmt **);
+int sql_finish(struct sqlite3_stmt *);
+int sql_flush_downloads(struct rekey_session *, int);
 int krealm_init(struct rekey_session *);
 int kadm_init(struct rekey_session *);
+void kadm_release(struct rekey_session *, int);
+struct timeval;
+void kadm_timing(struct rekey_session *, char *, struct timeval *);
+void kadm_limit_init(void);
+int kadm_limit_enter(struct rekey_session *);
+void kadm_limit_leave(struct rekey_session *);
 void admin_arg(char *);
+void admin_init(void);
 int is_admin(struct rekey_session *);
+void admin_cache_init(void);
+int admin_cache_check(struct rekey_session *,
+                      int (*)(struct rekey_session *));
 struct ACL *acl_load(struct rekey_session *, char *);
 struct ACL *acl_load_builtin(struct rekey_session *, char *, char **);
 int acl_check(struct rekey_session *, struct ACL *, krb5_principal, int);
+int acl_check_linear(struct rekey_session *, struct ACL *, krb5_principal, int);
+void acl_free(struct rekey_session *, struct ACL *);
+struct acl_file *acl_file_load(struct rekey_session *, char *);
+struct ACL *acl_file_current(struct acl_file *);
+void acl_refresh_all(void);
+void acl_sighup(int);
 
 void fatal(const char *, ...)
 #ifdef HAVE___ATTRIBUTE__
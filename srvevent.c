@@ -0,0 +1,453 @@
+/*
+ * Copyright (c) 2008-2009, 2013 Carnegie Mellon University.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer. 
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * 3. The name "Carnegie Mellon University" must not be used to
+ *    endorse or promote products derived from this software without
+ *    prior written permission. For permission or any other legal
+ *    details, please contact  
+ *      Office of Technology Transfer
+ *      Carnegie Mellon University
+ *      5000 Forbes Avenue
+ *      Pittsburgh, PA  15213-3890
+ *      (412) 268-4387, fax: (412) 268-7395
+ *      tech-transfer@andrew.cmu.edu
+ *
+ * 4. Redistributions of any form whatsoever must retain the following
+ *    acknowledgment:
+ *    "This product includes software developed by Computing Services
+ *     at Carnegie Mellon University (http://www.cmu.edu/computing/)."
+ *
+ * CARNEGIE MELLON UNIVERSITY DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS, IN NO EVENT SHALL CARNEGIE MELLON UNIVERSITY BE LIABLE
+ * FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
+
+#define SESS_PRIVATE
+#define NEED_SSL
+#include "rekeysrv-locl.h"
+#include "rekey-locl.h"
+#include "protocol.h"
+#include "memmgt.h"
+
+int event_mode = 0;
+
+#ifdef HAVE_SYS_EPOLL_H
+
+#define EVENT_MAX_EVENTS 64
+
+/*
+ * A connection being driven by the event loop.  The session state machine
+ * is the same one used by the blocking server; the connection adds the
+ * partially read request and the queue of replies not yet written.
+ */
+struct conn {
+  struct conn *next, *prev;
+  time_t deadline;
+  const char *waiting_for;
+  int fd;
+  int listener;
+  int events;
+  int handshake_done;
+  int busy;
+  int closing;
+  unsigned char hdr[5];
+  unsigned int hdrlen;
+  unsigned int inlen;
+  mb_t in;
+  mb_t out;
+  size_t outoff;
+  struct rekey_session sess;
+};
+
+static int epfd = -1;
+static int nconns;
+static struct conn *conns;
+static struct conn *current;
+static jmp_buf conn_abort;
+
+/* fatal() while handling a connection only terminates that connection */
+static void event_fatal(void) 
+{
+  longjmp(conn_abort, 1);
+}
+
+/* What the connection is waiting for, and how long it may wait */
+static void conn_deadline(struct conn *c, const char *what, int secs) 
+{
+  c->waiting_for = what;
+  c->deadline = secs ? time(0) + secs : 0;
+}
+
+static void conn_close(struct conn *c) 
+{
+  if (c->next)
+    c->next->prev = c->prev;
+  if (c->prev)
+    c->prev->next = c->next;
+  else
+    conns = c->next;
+  /* sess_finalize makes a last attempt to send the queued replies; it
+     must not repeat what was already written */
+  if (c->outoff) {
+    memmove(c->out->value, (char *)c->out->value + c->outoff,
+            c->out->length - c->outoff);
+    buf_setlength(c->out, c->out->length - c->outoff);
+    c->outoff = 0;
+  }
+  if (c->sess.initialized)
+    sess_finalize(&c->sess);
+  close(c->fd);
+  if (c->in)
+    buf_free(c->in);
+  if (c->out)
+    buf_free(c->out);
+  free(c);
+  nconns--;
+  pool_sessions(nconns, 0, NULL);
+}
+
+static void conn_want(struct conn *c, int events) 
+{
+  struct epoll_event ev;
+
+  if (c->events == events)
+    return;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = events;
+  ev.data.ptr = c;
+  if (epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev))
+    fatal("epoll_ctl failed: %s", strerror(errno));
+  c->events = events;
+}
+
+/* Handle a failed non-blocking SSL call.  Returns 0 if the call should be
+   retried when the socket is ready, and -1 if the peer closed the
+   connection.  Any other error is fatal to the connection. */
+static int conn_ssl_wait(struct conn *c, int rc) 
+{
+  switch (SSL_get_error(c->sess.ssl, rc)) {
+  case SSL_ERROR_WANT_READ:
+    conn_want(c, EPOLLIN);
+    return 0;
+  case SSL_ERROR_WANT_WRITE:
+    conn_want(c, EPOLLOUT);
+    return 0;
+  case SSL_ERROR_ZERO_RETURN:
+    return -1;
+  }
+  ssl_fatal(c->sess.ssl, rc);
+}
+
+/* Read as much of the next request as is available.  Returns 1 when a
+   whole request is in c->in, 0 if more data is needed, and -1 if the
+   connection was closed. */
+static int conn_read_frame(struct conn *c) 
+{
+  int rc;
+  unsigned int len;
+
+  while (c->hdrlen < 5) {
+    rc = SSL_read(c->sess.ssl, c->hdr + c->hdrlen, 5 - c->hdrlen);
+    if (rc <= 0)
+      return conn_ssl_wait(c, rc);
+    if (c->hdrlen == 0)
+      conn_deadline(c, "request", request_timeout);
+    c->hdrlen += rc;
+    if (c->hdrlen == 5) {
+      len = ((unsigned int)c->hdr[1] << 24) | (c->hdr[2] << 16) |
+        (c->hdr[3] << 8) | c->hdr[4];
+      if (len > max_frame_size)
+        fatal("Message too large (%u bytes)", len);
+      if (buf_setlength(c->in, len))
+        fatal("memory allocation failed: %s", strerror(errno));
+      c->inlen = 0;
+    }
+  }
+  while (c->inlen < c->in->length) {
+    rc = SSL_read(c->sess.ssl, (char *)c->in->value + c->inlen,
+                  c->in->length - c->inlen);
+    if (rc <= 0)
+      return conn_ssl_wait(c, rc);
+    c->inlen += rc;
+  }
+  reset_cursor(c->in);
+  c->hdrlen = 0;
+  return 1;
+}
+
+/* Advance a connection as far as it can go without blocking */
+static void conn_run(struct conn *c) 
+{
+  int rc;
+
+  if (!c->handshake_done) {
+    rc = SSL_accept(c->sess.ssl);
+    if (rc != 1) {
+      if (conn_ssl_wait(c, rc) < 0)
+        conn_close(c);
+      return;
+    }
+    c->handshake_done = 1;
+    conn_deadline(c, "request", idle_timeout);
+  }
+
+  for (;;) {
+    /* replies are written out before the next request is read */
+    while (c->outoff < c->out->length) {
+      rc = SSL_write(c->sess.ssl, (char *)c->out->value + c->outoff,
+                     c->out->length - c->outoff);
+      if (rc <= 0) {
+        if (conn_ssl_wait(c, rc) < 0)
+          conn_close(c);
+        return;
+      }
+      c->outoff += rc;
+    }
+    if (c->out->length) {
+      buf_setlength(c->out, 0);
+      c->outoff = 0;
+      conn_deadline(c, "request", idle_timeout);
+    }
+    if (c->closing) {
+      conn_close(c);
+      return;
+    }
+
+    rc = conn_read_frame(c);
+    if (rc < 0) {
+      conn_close(c);
+      return;
+    }
+    if (rc == 0)
+      return;
+
+    c->sess.state = REKEY_SESSION_SENDING;
+    if (c->busy) {
+      char msg[64];
+      snprintf(msg, sizeof(msg), "Server busy, retry after %d seconds",
+               busy_retry);
+      send_error(&c->sess, ERR_BUSY, msg);
+      conn_deadline(c, "reply to be sent", request_timeout);
+      c->closing = 1;
+      continue;
+    }
+    sess_dispatch(&c->sess, c->hdr[0], c->in);
+    conn_deadline(c, "reply to be sent", request_timeout);
+    /* the database handle is shared by every session in this process;
+       give it up while waiting for the next request */
+    sql_release(&c->sess);
+  }
+}
+
+static void expire_conns(void) 
+{
+  struct conn *c, *next;
+  time_t now = time(0);
+
+  for (c = conns; c; c = next) {
+    next = c->next;
+    if (!c->deadline || c->deadline > now)
+      continue;
+    if (c->handshake_done && c->hdrlen == 0 && c->outoff == 0 &&
+        c->out->length == 0)
+      prtmsg("Closing idle session");
+    else
+      prtmsg("Timed out waiting for %s", c->waiting_for);
+    conn_close(c);
+  }
+}
+
+static void accept_conns(int lfd) 
+{
+  struct sockaddr_storage ss;
+  struct sockaddr *sa = (struct sockaddr *)&ss;
+  struct epoll_event ev;
+  socklen_t ssz;
+  struct conn *c;
+  int s, rc, n, rejected = 0;
+
+  for (;;) {
+    ssz = sizeof(ss);
+    s = accept(lfd, sa, &ssz);
+    if (s < 0)
+      break;
+    /* Past max_sessions, up to max_pending more connections are told to
+       come back later; beyond that, they are just closed.  In a pool,
+       every worker's connections count. */
+    n = max_sessions ? pool_sessions(nconns, 0, NULL) : 0;
+    if (max_sessions && n >= max_sessions + max_pending) {
+      close(s);
+      rejected++;
+      continue;
+    }
+    rc = fcntl(s, F_GETFL);
+    if (rc == -1 || fcntl(s, F_SETFL, rc | O_NONBLOCK)) {
+      close(s);
+      continue;
+    }
+    c = calloc(1, sizeof(struct conn));
+    if (c) {
+      c->in = buf_alloc(1);
+      c->out = buf_alloc(64);
+    }
+    if (!c || !c->in || !c->out) {
+      prtmsg("Cannot allocate memory for new connection");
+      if (c && c->in)
+        buf_free(c->in);
+      if (c && c->out)
+        buf_free(c->out);
+      free(c);
+      close(s);
+      continue;
+    }
+    c->fd = s;
+    c->busy = max_sessions && n >= max_sessions;
+    log_connection(sa);
+    sess_init(&c->sess, ssl_new_conn(s));
+    SSL_set_mode(c->sess.ssl, SSL_MODE_ENABLE_PARTIAL_WRITE |
+                 SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+#ifdef SSL_MODE_RELEASE_BUFFERS
+    /* most connections are idle most of the time */
+    SSL_set_mode(c->sess.ssl, SSL_MODE_RELEASE_BUFFERS);
+#endif
+    c->sess.outq = c->out;
+    conn_deadline(c, "handshake", handshake_timeout);
+    c->next = conns;
+    if (conns)
+      conns->prev = c;
+    conns = c;
+    nconns++;
+    pool_sessions(nconns, 0, NULL);
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = c->events = EPOLLIN;
+    ev.data.ptr = c;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, s, &ev)) {
+      prtmsg("epoll_ctl failed: %s", strerror(errno));
+      conn_close(c);
+      continue;
+    }
+  }
+  if (rejected)
+    prtmsg("Server busy: rejected %d connections", rejected);
+}
+
+/*
+ * Serve all connections from this process, using non-blocking I/O.  If
+ * done is not NULL, it is called periodically; once it returns true, no
+ * new connections are accepted, and this function returns when the
+ * existing ones have closed.
+ */
+void run_event_loop(int (*done)(void)) 
+{
+  struct epoll_event ev, events[EVENT_MAX_EVENTS];
+  struct conn *lc;
+  int *lfds, nlfds, i, n, draining = 0;
+
+  signal(SIGPIPE, SIG_IGN);
+  epfd = epoll_create(EVENT_MAX_EVENTS);
+  if (epfd < 0)
+    fatal("epoll_create failed: %s", strerror(errno));
+
+  nlfds = net_listeners(&lfds);
+  lc = calloc(nlfds, sizeof(struct conn));
+  if (!lc)
+    fatal("Cannot allocate memory: %s", strerror(errno));
+  for (i = 0; i < nlfds; i++) {
+    lc[i].fd = lfds[i];
+    lc[i].listener = 1;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = &lc[i];
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, lfds[i], &ev))
+      fatal("epoll_ctl failed: %s", strerror(errno));
+  }
+
+  for (;;) {
+    if (!draining && done && done()) {
+      for (i = 0; i < nlfds; i++)
+        epoll_ctl(epfd, EPOLL_CTL_DEL, lfds[i], &ev);
+      draining = 1;
+    }
+    if (draining && nconns == 0)
+      break;
+
+    n = epoll_wait(epfd, events, EVENT_MAX_EVENTS, 1000);
+    if (n < 0) {
+      if (errno != EINTR)
+        fatal("epoll_wait failed: %s", strerror(errno));
+      continue;
+    }
+    for (i = 0; i < n; i++) {
+      current = events[i].data.ptr;
+      if (current->listener) {
+        if (!draining)
+          accept_conns(current->fd);
+        continue;
+      }
+      if (setjmp(conn_abort) == 0) {
+        fatal_hook = event_fatal;
+        conn_run(current);
+      } else {
+        /* the handler never reached its own cleanup; don't leave its
+           transaction open or keep its kadmin connection and slot for
+           the connections still being served */
+        sql_release(&current->sess);
+        kadm_release(&current->sess, 1);
+        conn_close(current);
+      }
+      fatal_hook = NULL;
+    }
+    /* after the events, since this may free connections they refer to */
+    expire_conns();
+  }
+  close(epfd);
+  free(lc);
+}
+
+#else
+
+void run_event_loop(int (*done)(void)) 
+{
+  fatal("Event-driven mode is not supported on this system");
+}
+
+#endif
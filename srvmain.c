@@ -56,14 +56,20 @@
 #include <sys/socket.h>
 #include <sys/syslog.h>
 #include <sys/signal.h>
+#include <sys/wait.h>
 #include <arpa/inet.h>
+#include <time.h>
 
 #include "rekeysrv-locl.h"
 
 char *target_acl_path = NULL;
 int force_compat_enctype = 0;
+/* seconds; 0 means no limit */
+int handshake_timeout = 60;
+int request_timeout = 300;
+int idle_timeout = 300;
 
-void run_fg(int s, struct sockaddr *sa) {
+void log_connection(struct sockaddr *sa) {
   char addrstr[INET6_ADDRSTRLEN];
   if (sa->sa_family == AF_INET) {
     struct sockaddr_in *sin = (struct sockaddr_in *)sa;
@@ -84,12 +90,54 @@ void run_fg(int s, struct sockaddr *sa) {
   } else {
     syslog(LOG_INFO, "Connection from unknown address type %d", sa->sa_family);
   }
+}
+
+void run_fg(int s, struct sockaddr *sa) {
+  log_connection(sa);
   run_session(s);
   exit(0);
 }
-void run_one(int s, struct sockaddr *sa) {
+/*
+ * Admission control for fork-per-connection mode.  At most max_sessions
+ * children run at once; up to max_pending further connections are held
+ * (before the TLS handshake) until a child exits, and anything beyond
+ * that is closed immediately.
+ */
+int max_sessions = 0;
+int max_pending = 0;
+int busy_retry = 60;
+
+struct pending_conn {
+  int s;
+  struct sockaddr_storage ss;
+};
+static struct pending_conn *pending;
+static int npending, nactive;
+static unsigned long nrejected;
+
+static void sigchld_wake(int sig) {
+}
+
+void admission_init(void) {
+  if (!max_sessions) {
+    signal(SIGCHLD, SIG_IGN);
+    return;
+  }
+  if (max_pending) {
+    pending = calloc(max_pending, sizeof(struct pending_conn));
+    if (!pending)
+      fatal("Cannot allocate memory: %s", strerror(errno));
+  }
+  /* children are reaped (and counted) in admission_tick; the handler just
+     interrupts poll so that happens promptly */
+  signal(SIGCHLD, sigchld_wake);
+}
+
+static void start_one(int s, struct sockaddr *sa) {
   pid_t p;
 
+  /* pick up ACL changes here, so each child need not */
+  acl_refresh_all();
 #if 0
   p=0;
 #else
@@ -99,9 +147,58 @@ void run_one(int s, struct sockaddr *sa) {
 #endif
   if (p == 0)
     run_fg(s, sa);
+  if (p > 0)
+    nactive++;
   close(s);
 }
 
+void run_one(int s, struct sockaddr *sa) {
+  int held;
+
+  /* with -R, the other listeners' sessions count too */
+  if (max_sessions &&
+      pool_sessions(nactive, npending, &held) >= max_sessions) {
+    if (npending < max_pending && held < max_pending) {
+      pending[npending].s = s;
+      memcpy(&pending[npending].ss, sa, sizeof(struct sockaddr_storage));
+      npending++;
+      pool_sessions(nactive, npending, NULL);
+      return;
+    }
+    /* not worth a fork or a TLS handshake */
+    close(s);
+    nrejected++;
+    return;
+  }
+  start_one(s, sa);
+  pool_sessions(nactive, npending, NULL);
+}
+
+/* Reap exited children and start queued connections.  Always returns 0, so
+   it can be used as run_accept_loop's tick function. */
+int admission_tick(void) {
+  static time_t last_report;
+  int status;
+
+  while (waitpid(-1, &status, WNOHANG) > 0) {
+    if (nactive > 0)
+      nactive--;
+  }
+  while (npending &&
+         pool_sessions(nactive, npending, NULL) < max_sessions) {
+    start_one(pending[0].s, (struct sockaddr *)&pending[0].ss);
+    npending--;
+    memmove(pending, pending + 1, npending * sizeof(struct pending_conn));
+  }
+  pool_sessions(nactive, npending, NULL);
+  if (nrejected && time(0) != last_report) {
+    syslog(LOG_WARNING, "Server busy: rejected %lu connections", nrejected);
+    nrejected = 0;
+    last_report = time(0);
+  }
+  return 0;
+}
+
 static char *pidfile=NULL;
 static void sigdie(int sig) {
   if (pidfile)
@@ -109,6 +206,21 @@ static void sigdie(int sig) {
   _exit(255);
 }
 
+/* -t handshake[,request[,idle]] */
+static int parse_timeouts(char *arg)
+{
+  char *x;
+
+  handshake_timeout = strtol(arg, &x, 10);
+  if (*x == ',')
+    request_timeout = strtol(x + 1, &x, 10);
+  if (*x == ',')
+    idle_timeout = strtol(x + 1, &x, 10);
+  if (*x || handshake_timeout < 0 || request_timeout < 0 || idle_timeout < 0)
+    return 1;
+  return 0;
+}
+
 static void parse_enctypes(char *arg)
 {
   char *x = arg;
@@ -138,7 +250,11 @@ int main(int argc, char **argv) {
   int dofork=0;
   int inetd=0;
   int optch;
-  while ((optch=getopt(argc, argv, "a:cdip:E:T:")) != -1) {
+  int ncores=0;
+  int bench_count=0;
+  int init_db=0;
+  char *x;
+  while ((optch=getopt(argc, argv, "a:cdeg:ij:k:m:p:q:t:w:y:B:C:E:F:G:IJ:K:L:M:R:S:T:W:")) != -1) {
     switch (optch) {
     case 'a':
       admin_arg(optarg);
@@ -149,18 +265,171 @@ int main(int argc, char **argv) {
     case 'd':
       dofork=1;
       break;
+    case 'e':
+      event_mode=1;
+      break;
+    case 'g':
+      if (ssl_set_groups(optarg)) {
+        fprintf(stderr, "Invalid group list %s\n", optarg);
+        optind=0;
+      }
+      break;
     case 'i':
       inetd=1;
       break;
+    case 'j':
+      download_journal_count=strtol(optarg, &x, 10);
+      if (*x == ',')
+        download_journal_age=strtol(x+1, &x, 10);
+      if (*x || download_journal_count <= 0 || download_journal_age < 0) {
+        fprintf(stderr, "Invalid download journal limits %s\n", optarg);
+        optind=0;
+      }
+      break;
+    case 'k':
+      kadm_handle_lifetime=strtol(optarg, &x, 10);
+      if (*x || kadm_handle_lifetime < 0) {
+        fprintf(stderr, "Invalid kadmin handle lifetime %s\n", optarg);
+        optind=0;
+      }
+      break;
+    case 'm':
+      pool_max_requests=strtol(optarg, &x, 10);
+      if (*x || pool_max_requests < 0) {
+        fprintf(stderr, "Invalid worker request limit %s\n", optarg);
+        optind=0;
+      }
+      break;
     case 'p':
       pidfile=optarg;
       break;
+    case 'q':
+      max_pending=strtol(optarg, &x, 10);
+      if (*x || max_pending < 0) {
+        fprintf(stderr, "Invalid queue length %s\n", optarg);
+        optind=0;
+      }
+      break;
+    case 'y':
+      busy_retry=strtol(optarg, &x, 10);
+      if (*x || busy_retry < 0) {
+        fprintf(stderr, "Invalid retry time %s\n", optarg);
+        optind=0;
+      }
+      break;
+    case 'M':
+      max_sessions=strtol(optarg, &x, 10);
+      if (*x || max_sessions < 0) {
+        fprintf(stderr, "Invalid session limit %s\n", optarg);
+        optind=0;
+      }
+      break;
+    case 't':
+      if (parse_timeouts(optarg)) {
+        fprintf(stderr, "Invalid timeouts %s\n", optarg);
+        optind=0;
+      }
+      break;
+    case 'w':
+      pool_min_workers=strtol(optarg, &x, 10);
+      if (*x == ',')
+        pool_max_workers=strtol(x+1, &x, 10);
+      else
+        pool_max_workers=pool_min_workers;
+      if (*x || pool_min_workers < 1 || pool_max_workers < pool_min_workers) {
+        fprintf(stderr, "Invalid worker count %s\n", optarg);
+        optind=0;
+      }
+      break;
+    case 'B':
+      listen_backlog=atoi(optarg);
+      if (listen_backlog < 1) {
+        fprintf(stderr, "Invalid listen backlog %s\n", optarg);
+        optind=0;
+      }
+      break;
+    case 'C':
+      admin_cache_ttl=strtol(optarg, &x, 10);
+      if (*x == ',')
+        admin_cache_negative_ttl=strtol(x+1, &x, 10);
+      else
+        admin_cache_negative_ttl=admin_cache_ttl;
+      if (*x || admin_cache_ttl < 0 || admin_cache_negative_ttl < 0) {
+        fprintf(stderr, "Invalid admin cache times %s\n", optarg);
+        optind=0;
+      }
+      break;
     case 'E':
       parse_enctypes(optarg);
       break;
+    case 'F':
+      max_frame_size=strtoul(optarg, &x, 10);
+      if (*x || max_frame_size < 1024) {
+        fprintf(stderr, "Invalid maximum message size %s\n", optarg);
+        optind=0;
+      }
+      break;
+    case 'G':
+      bench_count=atoi(optarg);
+      if (bench_count < 1) {
+        fprintf(stderr, "Invalid handshake count %s\n", optarg);
+        optind=0;
+      }
+      break;
+    case 'I':
+      init_db=1;
+      break;
+    case 'J':
+      kadm_max_ops=strtol(optarg, &x, 10);
+      if (*x == ',')
+        kadm_admin_reserve=strtol(x+1, &x, 10);
+      if (*x || kadm_max_ops < 0 || kadm_admin_reserve < 0 ||
+          (kadm_max_ops && kadm_admin_reserve >= kadm_max_ops)) {
+        fprintf(stderr, "Invalid kadmin concurrency limit %s\n", optarg);
+        optind=0;
+      }
+      break;
+    case 'K':
+      kadm_rate=strtol(optarg, &x, 10);
+      if (*x == ',')
+        kadm_burst=strtol(x+1, &x, 10);
+      if (*x || kadm_rate < 0 || kadm_burst < 1) {
+        fprintf(stderr, "Invalid kadmin rate limit %s\n", optarg);
+        optind=0;
+      }
+      break;
+    case 'L':
+      listen_port=optarg;
+      break;
+    case 'R':
+      ncores=atoi(optarg);
+      if (ncores < 0) {
+        fprintf(stderr, "Invalid listener count %s\n", optarg);
+        optind=0;
+      }
+      listen_reuseport=1;
+      break;
+    case 'S':
+      ticket_lifetime=atoi(optarg);
+      if (ticket_lifetime < 1) {
+        fprintf(stderr, "Invalid ticket key lifetime %s\n", optarg);
+        optind=0;
+      }
+      break;
     case 'T':
       target_acl_path=optarg;
       break;
+    case 'W':
+      kadm_max_wait=strtol(optarg, &x, 10);
+      if (*x == ',')
+        kadm_admin_max_wait=strtol(x+1, &x, 10);
+      else
+        kadm_admin_max_wait=kadm_max_wait;
+      if (*x || kadm_max_wait < 0 || kadm_admin_max_wait < 0) {
+        fprintf(stderr, "Invalid kadmin queue times %s\n", optarg);
+        optind=0;
+      }
+      break;
     case '?':
       optind=0;
       break;
@@ -170,21 +439,89 @@ int main(int argc, char **argv) {
   }
   
   if (argc > optind) {
-    fprintf(stderr, "Usage: rekeysrv -i [-T targets]...\n");
-    fprintf(stderr, "       rekeysrv [-d] [-p pidfile] [-T targets]\n");
+    fprintf(stderr, "Usage: rekeysrv -i [-t timeouts] [-T targets]...\n");
+    fprintf(stderr, "       rekeysrv [-d] [-p pidfile] [-L port] [-B backlog] [-e]\n");
+    fprintf(stderr, "                [-w min[,max] [-m max] | -R count] [-M max [-q queue] [-y secs]]\n");
+    fprintf(stderr, "                [-g groups] [-S secs] [-F bytes] [-t timeouts] [-T targets]\n");
+    fprintf(stderr, "                [-C pos[,neg]] [-j count[,secs]] [-k secs]\n");
+    fprintf(stderr, "                [-K rate[,burst]] [-J max[,reserve]] [-W secs[,secs]]\n");
+    fprintf(stderr, "       rekeysrv [-g groups] -G count\n");
+    fprintf(stderr, "       rekeysrv -I\n");
     fprintf(stderr, "  -i          run under inetd\n");
     fprintf(stderr, "  -d          run as a background daemon\n");
     fprintf(stderr, "  -p file     PID file\n");
+    fprintf(stderr, "  -e          serve many connections per process with non-blocking I/O\n");
+    fprintf(stderr, "  -w min,max  use a pool of pre-forked workers\n");
+    fprintf(stderr, "  -m count    sessions each worker handles before exiting\n");
+    fprintf(stderr, "  -R count    run count listener processes (0 = one per CPU)\n");
+    fprintf(stderr, "  -M count    maximum concurrent sessions\n");
+    fprintf(stderr, "  -q count    connections to hold when -M is reached\n");
+    fprintf(stderr, "  -y secs     retry time suggested to clients when busy\n");
+    fprintf(stderr, "  -L port     listen on port instead of 4446\n");
+    fprintf(stderr, "  -B backlog  listen queue length\n");
+    fprintf(stderr, "  -g groups   key exchange groups, e.g. X25519:P-256:dh3072\n");
+    fprintf(stderr, "  -G count    time count handshakes with each group and exit\n");
+    fprintf(stderr, "  -I          create or upgrade the database and exit\n");
+    fprintf(stderr, "  -S secs     allow TLS 1.3 session resumption; rotate ticket keys every secs\n");
+    fprintf(stderr, "  -F bytes    largest request accepted\n");
+    fprintf(stderr, "  -t h,r,i    handshake, request and idle timeouts (seconds)\n");
     fprintf(stderr, "  -T file     ACL file listing permitted targets\n");
     fprintf(stderr, "  -c          force old enctype compatibility\n");
     fprintf(stderr, "  -E etypes   use only listed enctypes\n");
     fprintf(stderr, "  -a       %s\n", admin_help_string);
+    fprintf(stderr, "  -C pos,neg  seconds to cache LDAP admin checks (0 = don't)\n");
+    fprintf(stderr, "  -j cnt,secs journal downloads; record them every cnt or every secs\n");
+    fprintf(stderr, "  -k secs     reuse each process's kadmin connection for secs (0 = don't)\n");
+    fprintf(stderr, "  -K rate,n   start at most rate kadmin operations a second, n at once\n");
+    fprintf(stderr, "  -J max,res  run at most max kadmin operations; res only for admins\n");
+    fprintf(stderr, "  -W oth,adm  seconds to queue for kadmin before giving up\n");
     exit(1);
   }
+  if (bench_count) {
+    ssl_benchmark(bench_count);
+    exit(0);
+  }
+  if (init_db) {
+#ifdef LOG_PERROR
+    openlog("rekeysrv", LOG_PID | LOG_PERROR, LOG_DAEMON);
+#else
+    openlog("rekeysrv", LOG_PID, LOG_DAEMON);
+#endif
+    exit(sql_startup() ? 1 : 0);
+  }
   if (inetd && (dofork || pidfile)) {
     fprintf(stderr, "Can't fork or use pidfile when running under inetd\n");
     exit(1);
   }
+  if (inetd && ticket_lifetime) {
+    fprintf(stderr, "Can't use -S when running under inetd\n");
+    exit(1);
+  }
+  if (inetd && (pool_max_workers || event_mode)) {
+    fprintf(stderr, "Can't use worker pool or event mode when running under inetd\n");
+    exit(1);
+  }
+  if (max_sessions && pool_max_workers && !event_mode) {
+    fprintf(stderr, "Can't use -M with -w; the pool size limits sessions\n");
+    exit(1);
+  }
+  if (listen_reuseport) {
+#ifndef SO_REUSEPORT
+    fprintf(stderr, "SO_REUSEPORT is not supported on this system\n");
+    exit(1);
+#endif
+    if (inetd || pool_max_workers) {
+      fprintf(stderr, "Can't use -R with -i or -w\n");
+      exit(1);
+    }
+#ifdef _SC_NPROCESSORS_ONLN
+    if (ncores == 0)
+      ncores = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    if (ncores < 1)
+      ncores = 1;
+    pool_min_workers = pool_max_workers = ncores;
+  }
   if (dofork) {
 #ifdef HAVE_DAEMON
     if (daemon(0, 0)) {
@@ -220,13 +557,20 @@ int main(int argc, char **argv) {
     } else {
       pidfile=NULL;
     }
-    signal(SIGHUP, SIG_IGN);
     signal(SIGINT, sigdie);
     signal(SIGTERM, sigdie);
   }
   openlog("rekeysrv", LOG_PID, LOG_DAEMON);
 
+  if (sql_startup())
+    fatal("Cannot set up database %s", REKEY_LOCAL_DATABASE);
   ssl_startup();
+  sess_startup();
+  admin_init();
+  admin_cache_init();
+  kadm_limit_init();
+  /* SIGHUP reloads the ACL files */
+  signal(SIGHUP, acl_sighup);
   if (inetd) {
     struct sockaddr_storage ss;
     struct sockaddr *sa = (struct sockaddr *)&ss;
@@ -238,10 +582,19 @@ int main(int argc, char **argv) {
       exit (1);
     }
     run_fg(0, sa);
+  } else if (pool_max_workers) {
+    if (!listen_reuseport)
+      net_startup();
+    run_worker_pool();
+    if (pidfile)
+      unlink(pidfile);
+  } else if (event_mode) {
+    net_startup();
+    run_event_loop(NULL);
   } else {
-    signal(SIGCHLD, SIG_IGN);
+    admission_init();
     net_startup();
-    run_accept_loop(run_one);
+    run_accept_loop(run_one, max_sessions ? admission_tick : NULL);
   }
   exit(0);
 }
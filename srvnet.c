@@ -43,21 +43,34 @@
 #include "config.h"
 #endif
 #include <stdarg.h>
+#include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <poll.h>
+#include <signal.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/time.h>
 #include <netdb.h>
+#include <time.h>
 
 #define SESS_PRIVATE
 #define NEED_SSL
 #include "rekeysrv-locl.h"
+#include "rekey-locl.h"
+#include "protocol.h"
 
 #include <openssl/dh.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+#include <openssl/x509.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#endif
 #if OPENSSL_VERSION_NUMBER >= 0x0090800fL
 #ifndef OPENSSL_NO_EC
 #include <openssl/ec.h>
@@ -66,23 +79,58 @@
 #else
 #define OPENSSL_NO_EC
 #endif
+#if defined(TLS1_3_VERSION) && !defined(OPENSSL_NO_EC)
+#define REKEY_TLS13 1
+#endif
 
 #include "memmgt.h"
 
 static SSL_CTX *sslctx;
 
+#include "dhp2048.h"
+#include "dhp3072.h"
+#include "dhp4096.h"
 #include "dhp7680.h"
 
-static DH *get_dh(SSL *ssl, int is_export, int keysize) {
-  DH *ret;
-  if (is_export || keysize < 512 || keysize > 7680)
-    ret = NULL;
-  else
-    ret = get_dh7680();
-  return ret;
-}
+/* the DH groups shipped with rekey, usable as -g dhNNNN */
+static struct dh_group {
+  int bits;
+  DH *(*get)(void);
+} dh_groups[] = {
+  { 2048, get_dh2048 },
+  { 3072, get_dh3072 },
+  { 4096, get_dh4096 },
+  { 7680, get_dh7680 },
+  { 0, NULL }
+};
 
-#ifndef OPENSSL_NO_EC
+/* anonymous suites are refused above security level 0 */
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+#define REKEY_SECLEVEL ":@SECLEVEL=0"
+#else
+#define REKEY_SECLEVEL ""
+#endif
+#define REKEY_CIPHERS "aNULL:-eNULL:-EXPORT:-LOW:-MD5:@STRENGTH" REKEY_SECLEVEL
+/* same suites, but anonymous ECDH first; a DH exchange costs far more */
+#define REKEY_SERVER_CIPHERS REKEY_CIPHERS ":+kEDH"
+
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+static char *cfg_groups = "X25519:P-256:P-384";
+#else
+static char *cfg_groups = "P-256:P-384";
+#endif
+/* cfg_groups, if it was set by -g */
+static char *cfg_groups_alloc;
+static int cfg_dh_bits = 7680;
+
+/* if non-zero, TLS 1.3 clients are given session tickets, and the keys
+   protecting them change every ticket_lifetime seconds */
+int ticket_lifetime;
+#ifdef REKEY_TLS13
+static unsigned char ticket_secret[32];
+#endif
+
+#if !defined(OPENSSL_NO_EC) && !defined(SSL_CTX_set1_curves_list)
 static EC_KEY *get_ecdh(SSL *ssl, int is_export, int keysize) {
   EC_KEY *ret;
   if (is_export || keysize < 512 || keysize > 7680)
@@ -92,24 +140,377 @@ static EC_KEY *get_ecdh(SSL *ssl, int is_export, int keysize) {
   return ret;
 }
 #endif
+
+/*
+ * Parse the -g argument: a colon-separated list of EC groups in order of
+ * preference, optionally including one dhNNNN entry selecting the DH
+ * group used with clients that cannot do ECDH.  Returns non-zero if the
+ * list is invalid.
+ */
+int ssl_set_groups(char *arg) {
+  char *groups, *p, *tok;
+  int i, bits;
+
+  groups = malloc(strlen(arg) + 1);
+  if (!groups)
+    return 1;
+  *groups = 0;
+  for (tok = strtok(arg, ":"); tok; tok = strtok(NULL, ":")) {
+    if (!strncmp(tok, "dh", 2)) {
+      bits = strtol(tok + 2, &p, 10);
+      for (i = 0; dh_groups[i].bits && dh_groups[i].bits != bits; i++)
+        ;
+      if (*p || !dh_groups[i].bits) {
+        free(groups);
+        return 1;
+      }
+      cfg_dh_bits = bits;
+      continue;
+    }
+    if (*groups)
+      strcat(groups, ":");
+    strcat(groups, tok);
+  }
+  /* a later -g replaces an earlier one */
+  free(cfg_groups_alloc);
+  cfg_groups_alloc = NULL;
+  if (*groups)
+    cfg_groups = cfg_groups_alloc = groups;
+  else {
+    cfg_groups = NULL;
+    free(groups);
+  }
+  return 0;
+}
+
+static SSL_CTX *new_server_ctx(const char *ciphers, const char *groups,
+                               int dh_bits) {
+  SSL_CTX *ctx;
+  DH *dh;
+  int i;
+  long opts = SSL_OP_NO_SSLv2|SSL_OP_NO_SSLv3|SSL_OP_NO_TICKET|
+    SSL_OP_CIPHER_SERVER_PREFERENCE;
+
+#ifdef SSL_OP_SINGLE_DH_USE
+  opts |= SSL_OP_SINGLE_DH_USE;
+#endif
+#ifdef SSL_OP_SINGLE_ECDH_USE
+  opts |= SSL_OP_SINGLE_ECDH_USE;
+#endif
+  ctx=SSL_CTX_new(TLS_server_method());
+  if (!ctx)
+    ssl_fatal(NULL, 0);
+  if (SSL_CTX_set_cipher_list(ctx, ciphers) == 0)
+    ssl_fatal(NULL, 0);
+  SSL_CTX_set_options(ctx, opts);
+  SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF);
+#ifdef TLS1_3_VERSION
+  SSL_CTX_set_num_tickets(ctx, 0);
+#endif
+
+  /* the parameters are copied into the context once, rather than being
+     generated by a callback for every handshake */
+  for (i = 0; dh_groups[i].bits && dh_groups[i].bits != dh_bits; i++)
+    ;
+  if (dh_groups[i].bits) {
+    dh = dh_groups[i].get();
+    if (!dh || SSL_CTX_set_tmp_dh(ctx, dh) == 0)
+      ssl_fatal(NULL, 0);
+    DH_free(dh);
+  }
+#ifndef OPENSSL_NO_EC
+#ifdef SSL_CTX_set1_curves_list
+  if (groups && SSL_CTX_set1_curves_list(ctx, groups) == 0)
+    ssl_fatal(NULL, 0);
+#ifdef SSL_CTX_set_ecdh_auto
+  SSL_CTX_set_ecdh_auto(ctx, 1);
+#endif
+#else
+  SSL_CTX_set_tmp_ecdh_callback(ctx, get_ecdh);
+#endif
+#endif
+  return ctx;
+}
+
+#ifdef REKEY_TLS13
+/*
+ * TLS 1.3 has no anonymous key exchange, so the server presents a
+ * throwaway self-signed certificate.  Clients don't check it; the server
+ * is authenticated by GSSAPI and the channel binding instead.
+ */
+static void add_tls13_cert(SSL_CTX *ctx) {
+  EVP_PKEY_CTX *pctx;
+  EVP_PKEY *pkey = NULL;
+  X509 *x;
+  X509_NAME *name;
+
+  pctx = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, NULL);
+  if (!pctx || EVP_PKEY_keygen_init(pctx) <= 0 ||
+      EVP_PKEY_CTX_set_ec_paramgen_curve_nid(pctx, NID_X9_62_prime256v1) <= 0 ||
+      EVP_PKEY_keygen(pctx, &pkey) <= 0)
+    ssl_fatal(NULL, 0);
+  EVP_PKEY_CTX_free(pctx);
+
+  x = X509_new();
+  if (!x || !X509_set_version(x, 2) ||
+      !ASN1_INTEGER_set(X509_get_serialNumber(x), 1) ||
+      !X509_gmtime_adj(X509_getm_notBefore(x), -86400) ||
+      !X509_gmtime_adj(X509_getm_notAfter(x), 3650L * 86400))
+    ssl_fatal(NULL, 0);
+  name = X509_get_subject_name(x);
+  if (!X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC,
+                                  (unsigned char *)"rekeysrv", -1, -1, 0) ||
+      !X509_set_issuer_name(x, name) || !X509_set_pubkey(x, pkey) ||
+      !X509_sign(x, pkey, EVP_sha256()))
+    ssl_fatal(NULL, 0);
+  if (SSL_CTX_use_certificate(ctx, x) != 1 ||
+      SSL_CTX_use_PrivateKey(ctx, pkey) != 1)
+    ssl_fatal(NULL, 0);
+  X509_free(x);
+  EVP_PKEY_free(pkey);
+}
+
+/* Clients that don't offer REKEY_ALPN bind authentication to the finished
+   messages, which TLS 1.3 doesn't protect the same way; hold them to
+   TLS 1.2. */
+static int check_client_hello(SSL *ssl, int *al, void *arg) {
+  const unsigned char *p;
+  size_t len, plen;
+
+  if (SSL_client_hello_get0_ext(ssl,
+                                TLSEXT_TYPE_application_layer_protocol_negotiation,
+                                &p, &len) == 1 && len >= 2) {
+    p += 2;
+    len -= 2;
+    while (len > 0) {
+      plen = p[0];
+      if (plen + 1 > len)
+        break;
+      if (plen == sizeof(REKEY_ALPN) - 1 &&
+          !memcmp(p + 1, REKEY_ALPN, plen)) {
+        /* the exporter binding stays unique when a session is resumed,
+           so these clients may have a ticket */
+        if (ticket_lifetime) {
+          SSL_clear_options(ssl, SSL_OP_NO_TICKET);
+          SSL_set_num_tickets(ssl, 1);
+        }
+        return SSL_CLIENT_HELLO_SUCCESS;
+      }
+      p += plen + 1;
+      len -= plen + 1;
+    }
+  }
+  if (!SSL_set_max_proto_version(ssl, TLS1_2_VERSION))
+    return SSL_CLIENT_HELLO_ERROR;
+  return SSL_CLIENT_HELLO_SUCCESS;
+}
+
+/*
+ * Ticket keys are derived from a secret chosen at startup and the number
+ * of the current ticket_lifetime period, so every process forked from
+ * this one rotates to the same keys at the same time without talking to
+ * the others.  Tickets issued in the previous period are still accepted.
+ */
+static void ticket_keys(long period, unsigned char *name,
+                        unsigned char *aes, unsigned char *mac) {
+  unsigned char in[9], out[EVP_MAX_MD_SIZE];
+  unsigned int len;
+  int i;
+
+  for (i = 0; i < 8; i++)
+    in[i] = (period >> (56 - 8 * i)) & 0xff;
+  in[8] = 'n';
+  HMAC(EVP_sha256(), ticket_secret, sizeof(ticket_secret), in, 9, out, &len);
+  memcpy(name, out, 16);
+  in[8] = 'e';
+  HMAC(EVP_sha256(), ticket_secret, sizeof(ticket_secret), in, 9, aes, &len);
+  in[8] = 'm';
+  HMAC(EVP_sha256(), ticket_secret, sizeof(ticket_secret), in, 9, mac, &len);
+  memset(out, 0, sizeof(out));
+}
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+typedef EVP_MAC_CTX TICKET_MAC_CTX;
+static int ticket_mac_init(EVP_MAC_CTX *hctx, unsigned char *key) {
+  OSSL_PARAM params[2];
+
+  params[0] = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST,
+                                               "SHA256", 0);
+  params[1] = OSSL_PARAM_construct_end();
+  return EVP_MAC_init(hctx, key, 32, params);
+}
+#else
+typedef HMAC_CTX TICKET_MAC_CTX;
+static int ticket_mac_init(HMAC_CTX *hctx, unsigned char *key) {
+  return HMAC_Init_ex(hctx, key, 32, EVP_sha256(), NULL);
+}
+#endif
+
+static int ticket_key_cb(SSL *ssl, unsigned char *name, unsigned char *iv,
+                         EVP_CIPHER_CTX *ectx, TICKET_MAC_CTX *hctx,
+                         int enc) {
+  unsigned char kname[16], aes[32], mac[32];
+  long period = time(0) / ticket_lifetime;
+  int ret = -1;
+
+  /* finished message bindings are not safe with resumption */
+  if (SSL_version(ssl) < TLS1_3_VERSION)
+    return 0;
+  if (enc) {
+    ticket_keys(period, name, aes, mac);
+    if (RAND_bytes(iv, EVP_MAX_IV_LENGTH) == 1 &&
+        EVP_EncryptInit_ex(ectx, EVP_aes_256_cbc(), NULL, aes, iv) == 1 &&
+        ticket_mac_init(hctx, mac) == 1)
+      ret = 1;
+  } else {
+    /* a client keeps only its newest ticket, so always send it another
+       (return 2) to replace the one being used */
+    ticket_keys(period, kname, aes, mac);
+    if (memcmp(name, kname, 16))
+      ticket_keys(--period, kname, aes, mac);
+    ret = memcmp(name, kname, 16) ? 0 : 2;
+    if (ret && (EVP_DecryptInit_ex(ectx, EVP_aes_256_cbc(), NULL, aes, iv) != 1 ||
+                ticket_mac_init(hctx, mac) != 1))
+      ret = -1;
+  }
+  memset(aes, 0, sizeof(aes));
+  memset(mac, 0, sizeof(mac));
+  return ret;
+}
+
+static void ticket_startup(SSL_CTX *ctx) {
+  if (RAND_bytes(ticket_secret, sizeof(ticket_secret)) != 1)
+    ssl_fatal(NULL, 0);
+  SSL_CTX_set_timeout(ctx, 2 * ticket_lifetime);
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+  if (!SSL_CTX_set_tlsext_ticket_key_evp_cb(ctx, ticket_key_cb))
+#else
+  if (!SSL_CTX_set_tlsext_ticket_key_cb(ctx, ticket_key_cb))
+#endif
+    ssl_fatal(NULL, 0);
+}
+#endif
+
 void ssl_startup(void) {
-  int rc;
   SSL_library_init();
   ERR_load_crypto_strings();
   ERR_load_SSL_strings();
   
-  sslctx=SSL_CTX_new(SSLv23_server_method());
-  if (!sslctx)
+  sslctx=new_server_ctx(REKEY_SERVER_CIPHERS, cfg_groups, cfg_dh_bits);
+#ifdef REKEY_TLS13
+  add_tls13_cert(sslctx);
+  SSL_CTX_set_client_hello_cb(sslctx, check_client_hello, NULL);
+  if (ticket_lifetime)
+    ticket_startup(sslctx);
+#else
+  if (ticket_lifetime)
+    fatal("Session resumption requires TLS 1.3 support in OpenSSL");
+#endif
+}
+
+/* Do one handshake between s and c, which are connected by a BIO pair.
+   Returns the server CPU time used, or -1 if the handshake failed. */
+static clock_t bench_handshake(SSL *s, SSL *c) {
+  clock_t used = 0, t;
+  int rs = 0, rc = 0, n;
+
+  for (n = 0; n < 100 && (rs != 1 || rc != 1); n++) {
+    if (rc != 1) {
+      rc = SSL_do_handshake(c);
+      if (rc != 1 && SSL_get_error(c, rc) != SSL_ERROR_WANT_READ &&
+          SSL_get_error(c, rc) != SSL_ERROR_WANT_WRITE)
+        return -1;
+    }
+    if (rs != 1) {
+      t = clock();
+      rs = SSL_do_handshake(s);
+      used += clock() - t;
+      if (rs != 1 && SSL_get_error(s, rs) != SSL_ERROR_WANT_READ &&
+          SSL_get_error(s, rs) != SSL_ERROR_WANT_WRITE)
+        return -1;
+    }
+  }
+  return (rs == 1 && rc == 1) ? used : -1;
+}
+
+static void bench_one(const char *label, const char *ciphers,
+                      const char *groups, int dh_bits, int count) {
+  SSL_CTX *sctx, *cctx;
+  SSL *s, *c;
+  BIO *sb, *cb;
+  clock_t used, total = 0;
+  const char *cipher = NULL;
+  int i;
+
+  sctx = new_server_ctx(ciphers, groups, dh_bits);
+  cctx = SSL_CTX_new(TLS_client_method());
+  if (!cctx || SSL_CTX_set_cipher_list(cctx, ciphers) == 0)
     ssl_fatal(NULL, 0);
-  rc=SSL_CTX_set_cipher_list(sslctx, "aNULL:-eNULL:-EXPORT:-LOW:-MD5:@STRENGTH");
-  if (rc == 0)
+#if !defined(OPENSSL_NO_EC) && defined(SSL_CTX_set1_curves_list)
+  if (groups && SSL_CTX_set1_curves_list(cctx, groups) == 0)
     ssl_fatal(NULL, 0);
-  SSL_CTX_set_options(sslctx, SSL_OP_NO_SSLv2|SSL_OP_NO_SSLv3|SSL_OP_NO_TICKET);
-  SSL_CTX_set_session_cache_mode(sslctx, SSL_SESS_CACHE_OFF);
-  SSL_CTX_set_tmp_dh_callback(sslctx, get_dh);
+#endif
+
+  for (i = 0; i < count; i++) {
+    s = SSL_new(sctx);
+    c = SSL_new(cctx);
+    if (!s || !c || !BIO_new_bio_pair(&sb, 0, &cb, 0))
+      ssl_fatal(NULL, 0);
+    SSL_set_bio(s, sb, sb);
+    SSL_set_bio(c, cb, cb);
+    SSL_set_accept_state(s);
+    SSL_set_connect_state(c);
+    used = bench_handshake(s, c);
+    if (used == (clock_t)-1) {
+      printf("%-10s handshake failed\n", label);
+      ERR_print_errors_fp(stdout);
+      SSL_free(s);
+      SSL_free(c);
+      goto out;
+    }
+    if (!cipher)
+      cipher = SSL_get_cipher_name(s);
+    total += used;
+    SSL_free(s);
+    SSL_free(c);
+  }
+  if (total == 0)
+    total = 1;
+  printf("%-10s %10.1f   %s\n", label,
+         (double)count * CLOCKS_PER_SEC / total, cipher);
+ out:
+  SSL_CTX_free(cctx);
+  SSL_CTX_free(sctx);
+}
+
+/*
+ * Report how many handshakes per second of server CPU time can be done
+ * with each of the configured EC groups and each of the DH groups, so
+ * that a -g policy can be chosen.
+ */
+void ssl_benchmark(int count) {
+  char label[16], *groups, *tok;
+  int i;
+
+  SSL_library_init();
+  ERR_load_crypto_strings();
+  ERR_load_SSL_strings();
+
+  printf("%-10s %10s   %s\n", "Group", "Hs/sec", "Cipher");
 #ifndef OPENSSL_NO_EC
-  SSL_CTX_set_tmp_ecdh_callback(sslctx, get_ecdh);
+  if (cfg_groups) {
+    groups = strdup(cfg_groups);
+    if (!groups)
+      fatal("Out of memory");
+    for (tok = strtok(groups, ":"); tok; tok = strtok(NULL, ":"))
+      bench_one(tok, "AECDH:-eNULL" REKEY_SECLEVEL, tok, 0, count);
+    free(groups);
+  }
 #endif
+  for (i = 0; dh_groups[i].bits; i++) {
+    snprintf(label, sizeof(label), "dh%d", dh_groups[i].bits);
+    bench_one(label, "ADH:-eNULL" REKEY_SECLEVEL, NULL, dh_groups[i].bits, count);
+  }
 }
 
 void ssl_cleanup(void) {
@@ -125,6 +526,10 @@ void ssl_cleanup(void) {
 static int listenfds[16];
 static int nlfds;
 
+char *listen_port = "4446";
+int listen_backlog = 16;
+int listen_reuseport = 0;
+
 /* glibc 2.3.3 and solaris 8 don't define AI_NUMERICSERV, but will accept a
    numeric service anyway. gnulib's getaddrinfo.h/netdb.h supplies a
    definitition even if the
@@ -151,7 +556,7 @@ void net_startup(void) {
   ahints.ai_family = PF_UNSPEC;
   ahints.ai_socktype = SOCK_STREAM;
 
-  rc = getaddrinfo(NULL, "4446", &ahints, &conn);
+  rc = getaddrinfo(NULL, listen_port, &ahints, &conn);
   if (rc)
     fatal("socket setup failed: %s", gai_strerror(rc));
 
@@ -167,12 +572,21 @@ void net_startup(void) {
     }
 #endif
      setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+#ifdef SO_REUSEPORT
+    /* several processes each bind their own socket, and the kernel
+       spreads incoming connections across them */
+    if (listen_reuseport &&
+        setsockopt(s, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on))) {
+      close(s);
+      continue;
+    }
+#endif
     
     if (bind(s, p->ai_addr, p->ai_addrlen)) {
       close(s);
       continue;
     }
-    if (listen(s, 16)) {
+    if (listen(s, listen_backlog)) {
       close(s);
       continue;
     }
@@ -195,7 +609,7 @@ void net_startup(void) {
 }
 
 
-SSL *do_ssl_accept(int s) {
+SSL *ssl_new_conn(int s) {
   SSL *ret;
   int rc;
 
@@ -208,8 +622,55 @@ SSL *do_ssl_accept(int s) {
   rc=SSL_set_fd(ret, s);
   if (rc == 0)
     ssl_fatal(ret, rc);
-  
+  return ret;
+}
+
+static volatile sig_atomic_t io_expired;
+static int io_fd = -1;
+static const char *io_what;
+
+static void io_alarm(int sig) 
+{
+  io_expired = 1;
+  /* whatever read or write is in progress, or comes next, fails */
+  if (io_fd >= 0)
+    shutdown(io_fd, SHUT_RDWR);
+}
+
+/*
+ * Give up on the blocking connection s if what (the handshake, reading a
+ * request, writing a reply) has not finished in secs seconds.  This
+ * limits the whole exchange, not each read or write, so a peer sending a
+ * byte at a time cannot hold the process forever.  secs = 0 ends the
+ * exchange.  Only one connection per process can have a deadline.
+ */
+void set_io_deadline(int s, int secs, const char *what) {
+  struct sigaction sa;
+
+  alarm(0);
+  if (io_expired) {
+    prtmsg("Timed out waiting for %s", io_what);
+    io_expired = 0;
+  }
+  io_fd = s;
+  io_what = what;
+  if (secs == 0)
+    return;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = io_alarm;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGALRM, &sa, NULL);
+  alarm(secs);
+}
+
+SSL *do_ssl_accept(int s) {
+  SSL *ret;
+  int rc;
+
+  ret=ssl_new_conn(s);
+  set_io_deadline(s, handshake_timeout, "handshake");
   rc=SSL_accept(ret);
+  set_io_deadline(s, 0, NULL);
   if (rc != 1)
     ssl_fatal(ret, rc); /* probably wrong */
   
@@ -228,7 +689,54 @@ void child_cleanup(void)
   sslctx=NULL;
 }
 
-int run_accept_loop(void (*cb)(int , struct sockaddr *))
+/* Returns the number of listening sockets set up by net_startup */
+int net_listeners(int **fds)
+{
+  *fds = listenfds;
+  return nlfds;
+}
+
+/*
+ * Wait up to timeout milliseconds for a connection on any of the listening
+ * sockets, and accept it.  Used by pooled workers, which all share the
+ * listening sockets; losing the race for a connection to another worker
+ * is not an error.  sa must point to a struct sockaddr_storage.  Returns a
+ * blocking socket, or -1 if nothing was accepted.
+ */
+int net_accept(struct sockaddr *sa, int timeout)
+{
+  struct pollfd fdp[16];
+  socklen_t ssz;
+  int rc, i, s;
+
+  for (i=0; i<nlfds; i++) {
+    fdp[i].fd = listenfds[i];
+    fdp[i].events = POLLIN;
+  }
+  rc = poll(fdp, nlfds, timeout);
+  if (rc <= 0)
+    return -1;
+  for (i=0; i<nlfds; i++) {
+    if (!(fdp[i].revents & POLLIN))
+      continue;
+    ssz = sizeof(struct sockaddr_storage);
+    s = accept(fdp[i].fd, sa, &ssz);
+    if (s < 0)
+      continue;
+    rc = fcntl(s, F_GETFL);
+    if (rc == -1 || fcntl(s, F_SETFL, rc & (~O_NONBLOCK))) {
+      close(s);
+      continue;
+    }
+    return s;
+  }
+  return -1;
+}
+
+/* If tick is not NULL, it is called at least once a second and whenever
+   poll is interrupted by a signal, and the loop returns once it returns
+   true */
+int run_accept_loop(void (*cb)(int , struct sockaddr *), int (*tick)(void))
 {
   struct pollfd fdp[16];
   int rc, i, s, fails=0;
@@ -238,8 +746,12 @@ int run_accept_loop(void (*cb)(int , struct sockaddr *))
     fdp[i].events = POLLIN;
   }
   for (;;) {
-    rc = poll(fdp, nlfds, -1);
+    if (tick && tick())
+      return 0;
+    rc = poll(fdp, nlfds, tick ? 1000 : -1);
     if (rc < 0) {
+      if (errno == EINTR)
+        continue;
       if (fails++ > 5)
        fatal("poll failed: %s", strerror(errno));
       continue;
@@ -50,7 +50,10 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <poll.h>
+#include <time.h>
 #include <sys/types.h>
+#include <sys/time.h>
+#include <sys/stat.h>
 #include <sys/socket.h>
 #include <sys/syslog.h>
 #include <sys/signal.h>
@@ -72,6 +75,11 @@
 #include <gssapi/gssapi_krb5.h>
 #endif
 
+/* how long (seconds) do_finalize_req trusts the entry setup_principal saw */
+#define SETUP_ENTRY_REUSE 10
+
+#define KADM_BUSY_MSG "Server busy (too many kadmin operations), retry later"
+
 static krb5_enctype std_enctypes[] = {
   ENCTYPE_DES_CBC_CRC,
   ENCTYPE_DES3_CBC_SHA1,
@@ -133,6 +141,17 @@ static void check_authz(struct rekey_session *sess)
 }
 
 
+/*
+ * State which does not depend on the connection.  A pooled worker sets
+ * this up once and reuses it for every session it serves.
+ */
+static krb5_context worker_kctx;
+static struct ACL *worker_target_acl;
+static struct acl_file *worker_target_file;
+static gss_cred_id_t worker_cred = GSS_C_NO_CREDENTIAL;
+static struct stat worker_kt_stat;
+static time_t worker_kt_checked;
+
 /* check that the target principal is valid (in the correct realm, and
    any other checks we choose to implement (in testing, this includes
    restricting the first principal component to a specific string)) */
@@ -142,7 +161,9 @@ static int check_target(struct rekey_session *sess, krb5_principal target)
 {
   if (krealm_init(sess))
     return 1;
-  if (!acl_check(sess, sess->target_acl, target, 0)) {
+  if (!acl_check(sess, worker_target_file ?
+                 acl_file_current(worker_target_file) : worker_target_acl,
+                 target, 0)) {
     send_error(sess, ERR_AUTHZ, "Requested principal may not be modified");
     return 1;
   }
@@ -182,9 +203,8 @@ static int find_principal(struct rekey_session *sess, char *principal, sqlite_in
   sqlite3_stmt *getprinc=NULL;  
   int rc, match;
   
-  rc = sqlite3_prepare_v2(sess->dbh, 
-                          "SELECT id, kvno FROM principals WHERE name=?",
-                          -1, &getprinc, NULL);
+  rc = sql_prepare(sess, "SELECT id, kvno FROM principals WHERE name=?",
+                   &getprinc);
   if (rc != SQLITE_OK)
     goto dberr;
   rc = sqlite3_bind_text(getprinc, 1, principal, strlen(principal), SQLITE_STATIC);
@@ -201,7 +221,7 @@ static int find_principal(struct rekey_session *sess, char *principal, sqlite_in
     match++;
   }
   
-  rc = sqlite3_finalize(getprinc);
+  rc = sql_finish(getprinc);
   getprinc=NULL;
   if (rc != SQLITE_OK)
     goto dberr;
@@ -211,23 +231,28 @@ static int find_principal(struct rekey_session *sess, char *principal, sqlite_in
   match = -1;
  freeall:
   if (getprinc)
-    sqlite3_finalize(getprinc);  
+    sql_finish(getprinc);  
   return match;
 }
 
 /* create a principal in the local database.
    gets the new kvno by looking up the old one in the kdb and incrementing it.
-   Optionally creates the kdb entry if it does not exist */
+   Optionally creates the kdb entry if it does not exist; a new entry is
+   left disabled until do_finalize_req installs its keys.  The entry is
+   remembered in the session so that finalizing it need not fetch it again */
 static sqlite_int64 setup_principal(struct rekey_session *sess, char *principal, 
                                     krb5_principal target, int create, krb5_kvno *kvnop) 
 {
   int rc;
   struct sqlite3_stmt *ins=NULL;
   krb5_kvno kvno;
-  int match, created=0;
+  int match;
   kadm5_principal_ent_rec ke;
   sqlite_int64 princid=0;
+  struct timeval start;
 
+  memset(&ke, 0, sizeof(ke));
+  sess->setup_princid = 0;
   match = find_principal(sess, principal, NULL, NULL);
   if (match < 0)
     goto dberr;
@@ -240,31 +265,35 @@ static sqlite_int64 setup_principal(struct rekey_session *sess, char *principal,
   if (kadm_init(sess))
     goto interr;
 
- retry:
-  memset(&ke, 0, sizeof(ke));
+  gettimeofday(&start, NULL);
   rc = kadm5_get_principal(sess->kadm_handle, target, &ke, KADM5_KVNO | 
 			   KADM5_ATTRIBUTES | KADM5_PRINC_EXPIRE_TIME); 
+  kadm_timing(sess, "get_principal", &start);
   if (rc) {
     if (rc == KADM5_UNK_PRINC) {
-      if (create && !created) {
+      if (create) {
 	krb5_keyblock *new_keys = NULL;
 	int i, n_new_keys=0;
 	ke.principal = target;
+	ke.kvno = 1;
 	ke.princ_expire_time = 0;
 	ke.attributes = KRB5_KDB_DISALLOW_ALL_TIX | KRB5_KDB_NEW_PRINC;
+	gettimeofday(&start, NULL);
 	rc = kadm5_create_principal(sess->kadm_handle, &ke, 
-				    KADM5_PRINCIPAL | 
+				    KADM5_PRINCIPAL | KADM5_KVNO |
 				    KADM5_PRINC_EXPIRE_TIME | KADM5_ATTRIBUTES,
 				    "passwordisnotused");
+	kadm_timing(sess, "create_principal", &start);
 	memset(&ke, 0, sizeof(ke));
 	if (rc) {
 	  prtmsg("Cannot create principal %s: %s", principal, krb5_get_err_text(sess->kctx, rc));
 	  goto interr;
 	}
-	created=1;
 
+	gettimeofday(&start, NULL);
 	rc = kadm5_randkey_principal(sess->kadm_handle, target, &new_keys, 
 				     &n_new_keys);
+	kadm_timing(sess, "randkey_principal", &start);
 	if (rc) {
 	  prtmsg("Creating %s failed to randomize keys: %s", principal, 
 		 krb5_get_err_text(sess->kctx, rc));
@@ -279,47 +308,35 @@ static sqlite_int64 setup_principal(struct rekey_session *sess, char *principal,
 	   object using the kadmin library's free */
 	kadm5_free_name_list(sess->kadm_handle, (char **)new_keys, 0);
 #endif
-	ke.principal = target;
+	/* The entry is what was just created, except that randkey moved
+	   it to the next kvno; there is no need to fetch it */
+	ke.kvno = 2;
 	ke.princ_expire_time = 0;
-	ke.attributes = 0;
-	rc = kadm5_modify_principal(sess->kadm_handle, &ke, 
-				    KADM5_PRINC_EXPIRE_TIME | KADM5_ATTRIBUTES);
-	if (rc) {
-	  prtmsg("Creating %s failed to unlock new principal: %s", principal, 
-		 krb5_get_err_text(sess->kctx, rc));
-	  goto interr;
-	}
-	goto retry;
+	ke.attributes = KRB5_KDB_DISALLOW_ALL_TIX | KRB5_KDB_NEW_PRINC;
+	prtmsg("Created principal %s", principal);
       } else {
-	if (created) {
-	  prtmsg("Principal %s still does not exist after successful kadm5_create_principal", principal);
-	  send_error(sess, ERR_OTHER, "KDC error: Requested principal does not exist after being created");
-	} else {
-	  prtmsg("Principal %s does not exist", principal);
-	  send_error(sess, ERR_NOTFOUND, "Requested principal does not exist");
-	}
+	prtmsg("Principal %s does not exist", principal);
+	send_error(sess, ERR_NOTFOUND, "Requested principal does not exist");
         goto freeall;
       }
-     if (created)
-	  prtmsg("Created principal %s", principal);
     } else {
       prtmsg("Unable to lookup principal %s: %s", principal, 
 	     krb5_get_err_text(sess->kctx, rc));
       goto interr;
     }
   }
-  if ((ke.princ_expire_time && 
-       ke.princ_expire_time < time(0)) || 
-      (ke.attributes & KRB5_KDB_DISALLOW_ALL_TIX)) {
+  if ((ke.attributes & KRB5_KDB_NEW_PRINC) == 0 &&
+      ((ke.princ_expire_time && 
+        ke.princ_expire_time < time(0)) || 
+       (ke.attributes & KRB5_KDB_DISALLOW_ALL_TIX))) {
     prtmsg("Principal %s is disabled or expired (%ld %#lx)", principal,
 	   (long)ke.princ_expire_time, (long)ke.attributes);
     send_error(sess, ERR_NOTFOUND, "Requested principal is disabled or expired");
   }
   kvno = ke.kvno + 1;
 
-  rc = sqlite3_prepare_v2(sess->dbh, 
-			  "INSERT INTO principals (name, kvno) VALUES (?, ?);",
-			  -1, &ins, NULL);
+  rc = sql_prepare(sess, "INSERT INTO principals (name, kvno) VALUES (?, ?);",
+                   &ins);
   if (rc != SQLITE_OK)
     goto dberr;
   rc = sqlite3_bind_text(ins, 1, principal, strlen(principal), SQLITE_STATIC);
@@ -329,13 +346,20 @@ static sqlite_int64 setup_principal(struct rekey_session *sess, char *principal,
   if (rc != SQLITE_OK)
     goto dberr;
   sqlite3_step(ins);    
-  rc = sqlite3_finalize(ins);
+  rc = sql_finish(ins);
   ins=NULL;
   if (rc != SQLITE_OK)
     goto dberr;
   princid  = sqlite3_last_insert_rowid(sess->dbh);
   if (kvnop)
     *kvnop=kvno;
+  free(sess->setup_name);
+  sess->setup_name = strdup(principal);
+  if (sess->setup_name)
+    sess->setup_princid = princid;
+  sess->setup_kvno = ke.kvno;
+  sess->setup_attributes = ke.attributes;
+  sess->setup_time = time(0);
   goto freeall;
  dberr:
   prtmsg("database error: %s", sqlite3_errmsg(sess->dbh));
@@ -345,10 +369,10 @@ static sqlite_int64 setup_principal(struct rekey_session *sess, char *principal,
   send_error(sess, ERR_OTHER, "Server internal error");
  freeall:
   if (ins)
-    sqlite3_finalize(ins);
+    sql_finish(ins);
   if (sess->kadm_handle)
     kadm5_free_principal_ent(sess->kadm_handle, &ke);
-  sess->kadm_handle = NULL;
+  kadm_release(sess, princid == 0);
 
   return princid;
 }
@@ -380,9 +404,9 @@ static int generate_keys(struct rekey_session *sess, sqlite_int64 princid, int r
     pEtype=std_enctypes;
   else
     pEtype=cfg_enctypes;
-  rc = sqlite3_prepare_v2(sess->dbh, 
-			  "INSERT INTO keys (principal, enctype, key) VALUES (?, ?, ?);",
-			  -1, &ins, NULL);
+  rc = sql_prepare(sess,
+                   "INSERT INTO keys (principal, enctype, key) VALUES (?, ?, ?);",
+                   &ins);
   if (rc != SQLITE_OK)
     goto dberr;
   for (;*pEtype != ENCTYPE_NULL; pEtype++) {
@@ -414,7 +438,7 @@ static int generate_keys(struct rekey_session *sess, sqlite_int64 princid, int r
     if (rc != SQLITE_OK)
       goto dberr;
   }
-  rc = sqlite3_finalize(ins);
+  rc = sql_finish(ins);
   ins=NULL;
   if (rc != SQLITE_OK)
     goto dberr;
@@ -429,60 +453,82 @@ static int generate_keys(struct rekey_session *sess, sqlite_int64 princid, int r
   return 1;
 }
 
+/* Appends one key to a KEYS response, followed by the other DES enctypes
+   if it is a DES key.  Returns the number of keys added, or 0 if out of
+   memory. */
+static int append_key(mb_t buf, int enctype, const unsigned char *key,
+                      size_t l)
+{
+  if (buf_appendint(buf, enctype) || buf_appendint(buf, l) ||
+      buf_appenddata(buf, key, l))
+    return 0;
+  if (enctype == ENCTYPE_DES_CBC_CRC) {
+    if (buf_appendint(buf, ENCTYPE_DES_CBC_MD4) || buf_appendint(buf, l) ||
+        buf_appenddata(buf, key, l))
+      return 0;
+    if (buf_appendint(buf, ENCTYPE_DES_CBC_MD5) || buf_appendint(buf, l) ||
+        buf_appenddata(buf, key, l))
+      return 0;
+    return 3;
+  }
+  return 1;
+}
+
+/* Fills in the key count of a keyset started at <last> */
+static int end_keyset(mb_t buf, size_t last, int n)
+{
+  size_t curlen;
+
+  curlen = get_cursor(buf);
+  set_cursor(buf, last);
+  if (buf_putint(buf, n))
+    return 1;
+  set_cursor(buf, curlen);
+  return 0;
+}
+
 /* Adds a keyset to a partially initialized KEYS response */
 static int add_keys_one(struct rekey_session *sess, sqlite_int64 principal, mb_t buf) 
 {
   int rc;
   sqlite3_stmt *st=NULL;
-  int enctype, n;
-  size_t l, curlen, last;
+  int enctype, n, k;
+  size_t l, last;
   const unsigned char *key;
 
   last = get_cursor(buf); /* key count goes here */
   if (buf_appendint(buf, 0)) /* key count placeholder */
     goto memerr;
-  rc = sqlite3_prepare(sess->dbh,"SELECT enctype, key from keys where principal=?",
-		       -1, &st, NULL);
+  rc = sql_prepare(sess, "SELECT enctype, key from keys where principal=?",
+                   &st);
   if (rc != SQLITE_OK)
     goto dberr;
   
-    rc = sqlite3_bind_int64(st, 1, principal);
-    if (rc != SQLITE_OK)
-      goto dberr;
-    n=0;
-    while (SQLITE_ROW == sqlite3_step(st)) {
-      enctype = sqlite3_column_int(st, 0);
-      key = sqlite3_column_blob(st, 1);
-      l = sqlite3_column_bytes(st, 1);
-      if (key == NULL || l == 0)
-	goto interr;
-      if (enctype == 0)
-	goto dberr;
-      if (buf_appendint(buf, enctype) || buf_appendint(buf, l) ||
-	  buf_appenddata(buf, key, l))
-	goto memerr;
-      if (enctype == ENCTYPE_DES_CBC_CRC) {
-        if (buf_appendint(buf, ENCTYPE_DES_CBC_MD4) || buf_appendint(buf, l) ||
-            buf_appenddata(buf, key, l))
-          goto memerr;
-        if (buf_appendint(buf, ENCTYPE_DES_CBC_MD5) || buf_appendint(buf, l) ||
-            buf_appenddata(buf, key, l))
-          goto memerr;
-	n += 2;
-      }
-      n++;
-    }
-    curlen = get_cursor(buf);
-    set_cursor(buf, last);
-    if (buf_putint(buf, n))
+  rc = sqlite3_bind_int64(st, 1, principal);
+  if (rc != SQLITE_OK)
+    goto dberr;
+  n=0;
+  while (SQLITE_ROW == sqlite3_step(st)) {
+    enctype = sqlite3_column_int(st, 0);
+    key = sqlite3_column_blob(st, 1);
+    l = sqlite3_column_bytes(st, 1);
+    if (key == NULL || l == 0)
       goto interr;
-    set_cursor(buf, curlen);
-    rc = sqlite3_finalize(st);
-    if (rc != SQLITE_OK)
+    if (enctype == 0)
       goto dberr;
-    if (n == 0)   
-      goto interr;
-    return 0;
+    if ((k = append_key(buf, enctype, key, l)) == 0)
+      goto memerr;
+    n += k;
+  }
+  if (end_keyset(buf, last, n))
+    goto interr;
+  rc = sql_finish(st);
+  st=NULL;
+  if (rc != SQLITE_OK)
+    goto dberr;
+  if (n == 0)   
+    goto interr;
+  return 0;
  dberr:
   prtmsg("database error: %s", sqlite3_errmsg(sess->dbh));
   send_error(sess, ERR_OTHER, "Server internal error (database failure)");
@@ -494,7 +540,7 @@ static int add_keys_one(struct rekey_session *sess, sqlite_int64 principal, mb_t
   send_error(sess, ERR_OTHER, "Server internal error (out of memory)");
  freeall:
   if (st)
-    sqlite3_finalize(st);
+    sql_finish(st);
   return 1;
 }
 
@@ -533,51 +579,91 @@ static int do_purge(struct rekey_session *sess, sqlite_int64 princid)
   int rc;
   struct sqlite3_stmt *del;
 
-  rc = sqlite3_prepare_v2(sess->dbh, 
-			  "DELETE FROM keys WHERE principal = ?;",
-			  -1, &del, NULL);
+  rc = sql_prepare(sess, "DELETE FROM keys WHERE principal = ?;", &del);
   if (rc == SQLITE_OK) {
     rc = sqlite3_bind_int64(del, 1, princid);
     if (rc == SQLITE_OK)
       sqlite3_step(del);
-    rc = sqlite3_finalize(del);
+    rc = sql_finish(del);
     del=0;
   }
   if (rc == SQLITE_OK)
-    rc = sqlite3_prepare_v2(sess->dbh, 
-			    "DELETE FROM acl WHERE principal = ?;",
-			    -1, &del, NULL);
+    rc = sql_prepare(sess, "DELETE FROM acl WHERE principal = ?;", &del);
   if (rc == SQLITE_OK) {
     rc = sqlite3_bind_int64(del, 1, princid);
     if (rc == SQLITE_OK)
       sqlite3_step(del);
-    rc = sqlite3_finalize(del);
+    rc = sql_finish(del);
     del=0;
   }
   if (rc == SQLITE_OK)
-    rc = sqlite3_prepare_v2(sess->dbh, 
-			    "DELETE FROM principals WHERE id = ?;",
-			    -1, &del, NULL);
+    rc = sql_prepare(sess, "DELETE FROM principals WHERE id = ?;", &del);
   if (rc == SQLITE_OK) {
     rc = sqlite3_bind_int64(del, 1, princid);
     if (rc == SQLITE_OK)
       sqlite3_step(del);
-    rc = sqlite3_finalize(del);
+    rc = sql_finish(del);
     del=0;
   }
   return rc;
 }
 
+/* The outcome of an operation on one principal in a batch request */
+struct op_result {
+  int code;
+  char *msg;
+};
+
+/* Report a failure to finalize: into *res for a batch request, otherwise
+   to the client unless no_send is set */
+static void finalize_fail(struct rekey_session *sess, int no_send,
+                          struct op_result *res, int code, char *msg)
+{
+  if (res) {
+    res->code = code;
+    res->msg = msg;
+  } else if (no_send == 0) {
+    send_error(sess, code, msg);
+  }
+}
+
+/* Clear the flags setup_principal used to keep a principal it created
+   from being used before it has its real keys */
+static int unlock_new_principal(struct rekey_session *sess,
+                                krb5_principal target, krb5_flags attributes)
+{
+  kadm5_principal_ent_rec ke;
+  struct timeval start;
+  int rc;
+
+  memset(&ke, 0, sizeof(ke));
+  ke.principal = target;
+  ke.princ_expire_time = 0;
+  ke.attributes = attributes &
+    ~(KRB5_KDB_DISALLOW_ALL_TIX | KRB5_KDB_NEW_PRINC);
+  gettimeofday(&start, NULL);
+  rc = kadm5_modify_principal(sess->kadm_handle, &ke, 
+                              KADM5_PRINC_EXPIRE_TIME | KADM5_ATTRIBUTES);
+  kadm_timing(sess, "modify_principal", &start);
+  return rc;
+}
+
 /* attempt to update the kdb, given a request that has been commited
    by all its clients. If it fails, a message is stored in the database
-   to help debugging */
+   to help debugging.  The caller releases the kadm5 handle.
+   If this session just set up the request, the kdb entry it fetched
+   then is reused rather than looked up again. */
 static int do_finalize_req(struct rekey_session *sess, int no_send, 
-			   char *principal, sqlite_int64 princid, 
-			   krb5_principal target, krb5_kvno kvno) {
-  sqlite3_stmt *updmsg=NULL, *selkey=NULL;
+			   struct op_result *res, char *principal,
+			   sqlite_int64 princid, krb5_principal target,
+			   krb5_kvno kvno) {
+  sqlite3_stmt *updmsg=NULL, *selkey=NULL, *chk=NULL;
   int dbaction=0, rc, ret=1;
   unsigned int nk=0, enctype, keylen, i;
   kadm5_principal_ent_rec ke;
+  krb5_kvno kdc_kvno=0;
+  krb5_flags attributes=0;
+  struct timeval start;
 #ifdef HAVE_KADM5_CHPASS_PRINCIPAL_WITH_KEY
   krb5_key_data *k=NULL, *newk;
   int ksz = sizeof(krb5_key_data);
@@ -586,10 +672,29 @@ static int do_finalize_req(struct rekey_session *sess, int no_send,
   int ksz = sizeof(krb5_keyblock);
 #endif
   const unsigned char *keydata;
+
+  /* Hold the write lock until the request is purged, so that only one
+     session can finalize it.  Messages recorded along the way are kept
+     even if finalizing fails. */
+  if (sql_begin_trans(sess))
+    goto dberr;
+  dbaction=1;
+  rc = sql_prepare(sess, "SELECT id FROM principals WHERE id = ?;", &chk);
+  if (rc != SQLITE_OK)
+    goto dberr;
+  rc = sqlite3_bind_int64(chk, 1, princid);
+  if (rc != SQLITE_OK)
+    goto dberr;
+  if (sqlite3_step(chk) != SQLITE_ROW) {
+    prtmsg("Request for %s was already finalized", principal);
+    finalize_fail(sess, no_send, res, ERR_NOTFOUND, "Requested principal does not have rekey in progress");
+    goto freeall;
+  }
+  sql_finish(chk);
+  chk=NULL;
   
-  rc = sqlite3_prepare_v2(sess->dbh, 
-			  "UPDATE principals SET message = ? WHERE id = ?;",
-			  -1, &updmsg, NULL);
+  rc = sql_prepare(sess, "UPDATE principals SET message = ? WHERE id = ?;",
+                   &updmsg);
   if (rc != SQLITE_OK)
     goto dberr;
   rc = sqlite3_bind_int64(updmsg, 2, princid);
@@ -600,8 +705,24 @@ static int do_finalize_req(struct rekey_session *sess, int no_send,
     goto interr;
   memset(&ke, 0, sizeof(ke));
 
-  rc = kadm5_get_principal(sess->kadm_handle, target, &ke, KADM5_KVNO | 
-			   KADM5_ATTRIBUTES | KADM5_PRINC_EXPIRE_TIME);
+  if (sess->setup_princid == princid && sess->setup_kvno + 1 == kvno &&
+      !strcmp(sess->setup_name, principal) &&
+      time(0) - sess->setup_time < SETUP_ENTRY_REUSE) {
+    kdc_kvno = sess->setup_kvno;
+    attributes = sess->setup_attributes;
+    rc = 0;
+  } else {
+    gettimeofday(&start, NULL);
+    rc = kadm5_get_principal(sess->kadm_handle, target, &ke, KADM5_KVNO | 
+			     KADM5_ATTRIBUTES | KADM5_PRINC_EXPIRE_TIME);
+    kadm_timing(sess, "get_principal", &start);
+    if (rc == 0) {
+      kdc_kvno = ke.kvno;
+      attributes = ke.attributes;
+      kadm5_free_principal_ent(sess->kadm_handle, &ke);
+    }
+  }
+  sess->setup_princid = 0;
   if (rc) {
     if (rc == KADM5_UNK_PRINC) {
       prtmsg("Principal %s disappeared from kdc", principal);
@@ -611,8 +732,7 @@ static int do_finalize_req(struct rekey_session *sess, int no_send,
       if (rc == SQLITE_OK) {
 	sqlite3_step(updmsg); /* finalize in freeall */
       }
-      if (no_send == 0)
-        send_error(sess, ERR_OTHER, "Principal disappeared from kdc");
+      finalize_fail(sess, no_send, res, ERR_OTHER, "Principal disappeared from kdc");
       goto freeall;
     }
     prtmsg("Unable to lookup principal %s: %s", principal, 
@@ -620,22 +740,20 @@ static int do_finalize_req(struct rekey_session *sess, int no_send,
     goto interr;
   }
 
-  if (kvno != ke.kvno + 1) {
-    prtmsg("kvno of %s changed from %d to %d; not finalizing commit", principal, kvno - 1, ke.kvno);
+  if (kvno != kdc_kvno + 1) {
+    prtmsg("kvno of %s changed from %d to %d; not finalizing commit", principal, kvno - 1, kdc_kvno);
     rc = sqlite3_bind_text(updmsg, 2, "Principal's kvno changed on kdc", 
 			   strlen("Principal's kvno changed on kdc"), 
 			   SQLITE_STATIC);
     if (rc == SQLITE_OK) {
       sqlite3_step(updmsg); /* finalize in freeall */
     }
-    if (no_send == 0)
-      send_error(sess, ERR_OTHER, "Principal's kvno changed on kdc");
+    finalize_fail(sess, no_send, res, ERR_OTHER, "Principal's kvno changed on kdc");
     goto freeall;
   }
   
-  rc = sqlite3_prepare_v2(sess->dbh,
-			  "SELECT enctype, key FROM keys WHERE principal = ?;",
-			  -1, &selkey, NULL);
+  rc = sql_prepare(sess, "SELECT enctype, key FROM keys WHERE principal = ?;",
+                   &selkey);
   if (rc != SQLITE_OK)
     goto dberr;
   rc = sqlite3_bind_int64(selkey, 1, princid);
@@ -666,7 +784,7 @@ static int do_finalize_req(struct rekey_session *sess, int no_send,
 	goto memerr;
     }
   }
-  rc = sqlite3_finalize(selkey);
+  rc = sql_finish(selkey);
   selkey=NULL;
   if (rc != SQLITE_OK)
     goto dberr;
@@ -674,10 +792,13 @@ static int do_finalize_req(struct rekey_session *sess, int no_send,
     prtmsg("No keys found for %s; cannot commit", principal);
     goto interr;
   }
+  gettimeofday(&start, NULL);
 #ifdef HAVE_KADM5_CHPASS_PRINCIPAL_WITH_KEY
   rc = kadm5_chpass_principal_with_key(sess->kadm_handle, target, nk, k);
+  kadm_timing(sess, "chpass_principal_with_key", &start);
 #else
   rc = kadm5_setkey_principal(sess->kadm_handle, target, k, nk);
+  kadm_timing(sess, "setkey_principal", &start);
 #endif
   if (rc) {
     prtmsg("finalizing %s failed to update kdc with keys: %s", principal,
@@ -689,21 +810,34 @@ static int do_finalize_req(struct rekey_session *sess, int no_send,
     if (rc == SQLITE_OK) {
       sqlite3_step(updmsg); /* finalize in freeall */
     }
-    if (no_send == 0)
-      send_error(sess, ERR_OTHER, "Updating kdc failed");
+    finalize_fail(sess, no_send, res, ERR_OTHER, "Updating kdc failed");
     goto freeall;
   }
+  if (attributes & KRB5_KDB_NEW_PRINC) {
+    /* setup_principal left the new entry locked until it had real keys */
+    rc = unlock_new_principal(sess, target, attributes);
+    if (rc) {
+      prtmsg("finalizing %s failed to unlock new principal: %s", principal,
+	     krb5_get_err_text(sess->kctx, rc));
+      rc = sqlite3_bind_text(updmsg, 2, "unlocking new principal failed", 
+			     strlen("unlocking new principal failed"), 
+			     SQLITE_STATIC);
+      if (rc == SQLITE_OK) {
+	sqlite3_step(updmsg); /* finalize in freeall */
+      }
+      finalize_fail(sess, no_send, res, ERR_OTHER, "Updating kdc failed");
+      goto freeall;
+    }
+  }
   rc = sqlite3_bind_text(updmsg, 2, "kdc update succeeded", 
                          strlen("kdc update succeeded"), 
                          SQLITE_STATIC);
   if (rc == SQLITE_OK) {
     sqlite3_step(updmsg);
   }
-  sqlite3_finalize(updmsg);
+  sql_finish(updmsg);
   updmsg=NULL;
 
-  if (sql_begin_trans(sess))
-    goto dberr;
   dbaction=-1;
   rc = do_purge(sess, princid);
   if (rc != SQLITE_OK)
@@ -714,28 +848,26 @@ static int do_finalize_req(struct rekey_session *sess, int no_send,
   goto freeall;
  dberr:
   prtmsg("database error: %s", sqlite3_errmsg(sess->dbh));
-  if (no_send == 0)
-    send_error(sess, ERR_OTHER, "Server internal error (database failure)");
+  finalize_fail(sess, no_send, res, ERR_OTHER, "Server internal error (database failure)");
   goto freeall;
  interr:
-  if (no_send == 0)
-    send_error(sess, ERR_OTHER, "Server internal error");
+  finalize_fail(sess, no_send, res, ERR_OTHER, "Server internal error");
   goto freeall;
  memerr:
-  if (no_send == 0)
-    send_error(sess, ERR_OTHER, "Server internal error (out of memory)");
+  finalize_fail(sess, no_send, res, ERR_OTHER, "Server internal error (out of memory)");
   goto freeall;
  freeall:
+  if (chk)
+    sql_finish(chk);
   if (updmsg)
-    sqlite3_finalize(updmsg);
+    sql_finish(updmsg);
   if (selkey)
-    sqlite3_finalize(selkey);
+    sql_finish(selkey);
   if (dbaction > 0) {
     if (sql_commit_trans(sess)) {
       sql_rollback_trans(sess);
       ret=1;
-      if (no_send == 0)
-        send_error(sess, ERR_OTHER, "Server internal error (database failure)");
+      finalize_fail(sess, no_send, res, ERR_OTHER, "Server internal error (database failure)");
     }
   } else if (dbaction < 0)
     sql_rollback_trans(sess);
@@ -748,9 +880,6 @@ static int do_finalize_req(struct rekey_session *sess, int no_send,
 #endif
     }
   }
-  if (sess->kadm_handle)
-    kadm5_destroy(sess->kadm_handle);
-  sess->kadm_handle = NULL;
   return ret;
 }
 
@@ -761,9 +890,9 @@ static int check_uncommited(struct rekey_session *sess, sqlite_int64 princid)
   sqlite3_stmt *checkcomp;
   int rc, match;
   
-  rc = sqlite3_prepare_v2(sess->dbh,
-			  "SELECT principal FROM acl WHERE principal = ? AND completed = 0;",
-			  -1, &checkcomp, NULL);
+  rc = sql_prepare(sess,
+                   "SELECT principal FROM acl WHERE principal = ? AND completed = 0;",
+                   &checkcomp);
   if (rc != SQLITE_OK)
     goto dberr;
   rc = sqlite3_bind_int64(checkcomp, 1, princid);
@@ -773,7 +902,7 @@ static int check_uncommited(struct rekey_session *sess, sqlite_int64 princid)
   while (SQLITE_ROW == sqlite3_step(checkcomp)) {
     match++;
   }
-  rc = sqlite3_finalize(checkcomp);
+  rc = sql_finish(checkcomp);
   checkcomp=NULL;
   if (rc != SQLITE_OK)
     goto dberr;
@@ -782,10 +911,58 @@ static int check_uncommited(struct rekey_session *sess, sqlite_int64 princid)
   match = -1;
  freeall:
   if (checkcomp)
-    sqlite3_finalize(checkcomp);
+    sql_finish(checkcomp);
   return match;
 }
 
+/*
+ * Return the acceptor credentials for this process.  They are acquired
+ * the first time, and again if the keytab file has changed, which is
+ * checked at most once a second.  If they cannot be acquired, the GSSAPI
+ * library is left to find them for each session as before.
+ */
+static gss_cred_id_t acceptor_cred(void) 
+{
+  char ktname[1024], *path;
+  struct stat st;
+  OM_uint32 maj, min;
+  time_t now;
+
+  now = time(0);
+  if (worker_cred != GSS_C_NO_CREDENTIAL && now == worker_kt_checked)
+    return worker_cred;
+  worker_kt_checked = now;
+
+  memset(&st, 0, sizeof(st));
+  if (krb5_kt_default_name(worker_kctx, ktname, sizeof(ktname)) == 0) {
+    path = ktname;
+    if (!strncmp(path, "FILE:", 5))
+      path += 5;
+    else if (!strncmp(path, "WRFILE:", 7))
+      path += 7;
+    if (*path == '/' && stat(path, &st))
+      memset(&st, 0, sizeof(st));
+  }
+  if (worker_cred != GSS_C_NO_CREDENTIAL) {
+    if (st.st_dev == worker_kt_stat.st_dev &&
+        st.st_ino == worker_kt_stat.st_ino &&
+        st.st_size == worker_kt_stat.st_size &&
+        st.st_mtime == worker_kt_stat.st_mtime)
+      return worker_cred;
+    prtmsg("Keytab has changed; reacquiring acceptor credentials");
+    gss_release_cred(&min, &worker_cred);
+  }
+  worker_kt_stat = st;
+  maj = gss_acquire_cred(&min, GSS_C_NO_NAME, GSS_C_INDEFINITE,
+                         GSS_C_NO_OID_SET, GSS_C_ACCEPT, &worker_cred,
+                         NULL, NULL);
+  if (GSS_ERROR(maj)) {
+    prt_gss_error(GSS_C_NO_OID, maj, min);
+    worker_cred = GSS_C_NO_CREDENTIAL;
+  }
+  return worker_cred;
+}
+
 /* Process an AUTH request containing a gss context token. 
    Returns an AUTH or OK response if successful. */
 static void s_auth(struct rekey_session *sess, mb_t buf) {
@@ -818,7 +995,10 @@ static void s_auth(struct rekey_session *sess, mb_t buf) {
     goto badpkt;
   }
   memset(&out, 0, sizeof(out));
-  maj = gss_accept_sec_context(&min, &sess->gctx, GSS_C_NO_CREDENTIAL,
+  /* a multi-step exchange keeps the credentials it started with */
+  maj = gss_accept_sec_context(&min, &sess->gctx,
+			       sess->gctx == GSS_C_NO_CONTEXT ?
+			       acceptor_cred() : worker_cred,
 			       &in, GSS_C_NO_CHANNEL_BINDINGS,
 			       &sess->name, &sess->mech, &out, &rflag, NULL,
 			       NULL);
@@ -966,7 +1146,7 @@ static void s_autherr(struct rekey_session *sess, mb_t buf)
   
   sess_send(sess, RESP_OK, NULL);
   sess_finalize(sess);
-  exit(1);
+  fatal("Authentication failed on client");
  badpkt:
   send_error(sess, ERR_BADREQ, "Packet was too short for opcode");
   return;
@@ -978,8 +1158,6 @@ static void s_authchan(struct rekey_session *sess, mb_t buf)
 {
   OM_uint32 maj, min, qop;
   gss_buffer_desc in, out;
-  size_t flen;
-  unsigned char *p;
 
   if (sess->authstate == 0) {
     send_error(sess, ERR_AUTHZ, "Operation not allowed on unauthenticated connection");
@@ -990,27 +1168,9 @@ static void s_authchan(struct rekey_session *sess, mb_t buf)
     return;
   }
 
- flen = SSL_get_finished(sess->ssl, NULL, 0);
- if (flen == 0) {
-   send_fatal(sess, ERR_AUTHN, "ssl finished message not available");
-   fatal("Cannot authenticate: ssl finished message not available");
- }    
- in.length = 2 * flen;
- in.value = malloc(in.length);
- if (in.value == NULL) {
-   send_fatal(sess, ERR_AUTHN, "Internal error; out of memory");
-   fatal("Cannot authenticate: memory allocation failed: %s",
-         strerror(errno));
- }
- p=in.value;
- if (flen != SSL_get_peer_finished(sess->ssl, p, flen)) {
-   send_fatal(sess, ERR_AUTHN, "ssl finished message not available");
-   fatal("Cannot authenticate: ssl finished message not available or size changed(!)");
- }    
- p+=flen;
- if (flen != SSL_get_finished(sess->ssl, p, flen)) {
-   send_fatal(sess, ERR_AUTHN, "ssl finished message not available");
-   fatal("Cannot authenticate: ssl finished message not available or size changed(!)");
+ if (ssl_channel_binding(sess->ssl, 1, 1, &in)) {
+   send_fatal(sess, ERR_AUTHN, "channel binding data not available");
+   fatal("Cannot authenticate: channel binding data not available");
  }
 
  out.length = buf->length;
@@ -1027,22 +1187,17 @@ static void s_authchan(struct rekey_session *sess, mb_t buf)
    return;
  }
  
- p=in.value;
- if (flen != SSL_get_finished(sess->ssl, p, flen)) {
-   send_fatal(sess, ERR_AUTHN, "ssl finished message not available");
-   fatal("Cannot authenticate: ssl finished message not available or size changed(!)");
- }    
- p+=flen;
- if (flen != SSL_get_peer_finished(sess->ssl, p, flen)) {
-   send_fatal(sess, ERR_AUTHN, "ssl finished message not available");
-   fatal("Cannot authenticate: ssl finished message not available or size changed(!)");
+ free(in.value);
+ if (ssl_channel_binding(sess->ssl, 1, 0, &in)) {
+   send_fatal(sess, ERR_AUTHN, "channel binding data not available");
+   fatal("Cannot authenticate: channel binding data not available");
  }
  memset(&out, 0, sizeof(out));
  maj = gss_get_mic(&min, sess->gctx, GSS_C_QOP_DEFAULT, &in, &out);
  free(in.value);
  if (GSS_ERROR(maj)) {
    send_gss_error(sess, sess->mech, maj, min);
-   exit(1);
+   fatal("Cannot authenticate: cannot sign channel bindings");
  }
  buf_setlength(buf, 0);
  if (buf_appenddata(buf, out.value, out.length)) {
@@ -1080,7 +1235,7 @@ static void s_newreq(struct rekey_session *sess, mb_t buf)
   char **hostnames=NULL;
   unsigned int i, n, flags;
   int rc;
-  sqlite3_stmt *ins=NULL;
+  sqlite3_stmt *ins=NULL, *inshost=NULL;
   int dbaction=0;
   int no_send=0;
   sqlite_int64 princid;
@@ -1140,6 +1295,12 @@ static void s_newreq(struct rekey_session *sess, mb_t buf)
   if (sql_init(sess))
     goto dberrnomsg;
 
+  /* queue for kadmin before taking the database lock */
+  if (kadm_limit_enter(sess)) {
+    send_error(sess, ERR_BUSY, KADM_BUSY_MSG);
+    no_send = 1;
+    goto freeall;
+  }
   if (sql_begin_trans(sess))
     goto dberrnomsg;
   dbaction=-1;
@@ -1148,12 +1309,25 @@ static void s_newreq(struct rekey_session *sess, mb_t buf)
   if (princid == 0)
     goto freeall;
 
-  rc = sqlite3_prepare_v2(sess->dbh, 
-			  "INSERT INTO acl (principal, hostname) VALUES (?, ?);",
-			  -1, &ins, NULL);
+  rc = sql_prepare(sess, "INSERT OR IGNORE INTO hosts (name) VALUES (?);",
+                   &inshost);
+  if (rc != SQLITE_OK)
+    goto dberr;
+  rc = sql_prepare(sess,
+                   "INSERT INTO acl (principal, host) SELECT ?, id FROM hosts WHERE name = ?;",
+                   &ins);
   if (rc != SQLITE_OK)
     goto dberr;
   for (i=0; i < n; i++) {  
+    rc = sqlite3_bind_text(inshost, 1, hostnames[i], 
+                           strlen(hostnames[i]), SQLITE_STATIC);
+    if (rc != SQLITE_OK)
+      goto dberr;
+    sqlite3_step(inshost);    
+    rc = sqlite3_reset(inshost);
+    if (rc != SQLITE_OK)
+      goto dberr;
+
     rc = sqlite3_bind_int64(ins, 1, princid);
     if (rc != SQLITE_OK)
       goto dberr;
@@ -1166,7 +1340,11 @@ static void s_newreq(struct rekey_session *sess, mb_t buf)
     if (rc != SQLITE_OK)
       goto dberr;
   }
-  rc = sqlite3_finalize(ins);
+  rc = sql_finish(inshost);
+  inshost=NULL;
+  if (rc != SQLITE_OK)
+    goto dberr;
+  rc = sql_finish(ins);
   ins=NULL;
   if (rc != SQLITE_OK)
     goto dberr;
@@ -1194,8 +1372,10 @@ static void s_newreq(struct rekey_session *sess, mb_t buf)
   send_error(sess, ERR_BADREQ, "Packet was corrupt or too short");
   no_send = 1;
  freeall:
+  if (inshost)
+    sql_finish(inshost);
   if (ins)
-    sqlite3_finalize(ins);
+    sql_finish(ins);
   if (dbaction > 0) {
     if (sql_commit_trans(sess)) {
       sql_rollback_trans(sess);
@@ -1207,6 +1387,7 @@ static void s_newreq(struct rekey_session *sess, mb_t buf)
     }
   } else if (dbaction < 0)
     sql_rollback_trans(sess);
+  kadm_limit_leave(sess);
 
   if (target)
     krb5_free_principal(sess->kctx, target);
@@ -1242,6 +1423,7 @@ static void s_status(struct rekey_session *sess, mb_t buf)
   prtmsg("getstatus for %s", principal);
   if (sql_init(sess))
     goto dberrnomsg;
+  sql_flush_downloads(sess, 1);
   
   rc = find_principal(sess, principal, &princid, &kvno);
   if (rc < 0)
@@ -1250,9 +1432,9 @@ static void s_status(struct rekey_session *sess, mb_t buf)
     send_error(sess, ERR_NOTFOUND, "Requested principal does not have rekey in progress");
     goto freeall;
   }
-  rc = sqlite3_prepare_v2(sess->dbh, 
-                          "SELECT hostname,completed,attempted FROM principals,acl WHERE name=? AND principal = id",
-                          -1, &st, NULL);
+  rc = sql_prepare(sess,
+                   "SELECT hosts.name,completed,attempted FROM principals,acl,hosts WHERE principals.name=? AND principal = principals.id AND host = hosts.id",
+                   &st);
   if (rc != SQLITE_OK)
     goto dberr;
   rc = sqlite3_bind_text(st, 1, principal, strlen(principal), SQLITE_STATIC);
@@ -1280,7 +1462,7 @@ static void s_status(struct rekey_session *sess, mb_t buf)
     n++;
   }
   
-  rc = sqlite3_finalize(st);
+  rc = sql_finish(st);
   st=NULL;
   if (rc != SQLITE_OK)
     goto dberr;
@@ -1307,21 +1489,38 @@ static void s_status(struct rekey_session *sess, mb_t buf)
   send_error(sess, ERR_BADREQ, "Packet was corrupt or too short");
  freeall:
   if (st)
-    sqlite3_finalize(st);
+    sql_finish(st);
   free(principal);
 }
 
 /* process a GETKEYS request. Returns all the keys the host should
    add to its keytab. Produces a KEYS response if successful */
+static void send_nokeys(struct rekey_session *sess, int some)
+{
+  if (some)
+    send_error(sess, ERR_NOKEYS, "None of the requested keys are available for this host");
+  else
+    send_error(sess, ERR_NOKEYS, "No keys available for this host");
+  prtmsg("getnewkeys: No applicable keys available");
+}
+
+static int compare_names(const void *a, const void *b)
+{
+  return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
 static void s_getkeys(struct rekey_session *sess, mb_t buf)
 {
-  int m, rc;
+  int m, nk, k, rc, enctype;
   sqlite3_stmt *st=NULL, *updatt=NULL, *updcount=NULL;
-  sqlite_int64 principal;
+  sqlite_int64 principal, current=0;
   const char *pname;
+  const unsigned char *key;
   char **names=NULL;
   unsigned int i, n;
+  size_t l, last=0;
   krb5_kvno kvno;
+  int skip=0;
   int dbaction=0;
   int no_send = 0;
     
@@ -1346,104 +1545,154 @@ static void s_getkeys(struct rekey_session *sess, mb_t buf)
       }
     }
   }
-  if (names)
+  if (names) {
     prtmsg("Getkeys for %d principals\n", n);
-  else
+    qsort(names, n, sizeof(char *), compare_names);
+  } else
     prtmsg("Getkeys for all available\n");
   if (sql_init(sess))
     goto dberrnomsg;
 
-  if (sql_begin_trans(sess))
-    goto dberrnomsg;
-  dbaction=-1;
-  
-  rc = sqlite3_prepare(sess->dbh,"SELECT id, name, kvno FROM principals, acl WHERE acl.hostname=? AND acl.principal=principals.id",
-                       -1, &st, NULL);
-
+  /* most of the time there is nothing for this host; find that out
+     without waiting for the write lock */
+  rc = sql_prepare(sess,
+                   "SELECT 1 FROM acl WHERE host=(SELECT id FROM hosts WHERE name=?) LIMIT 1;",
+                   &st);
   if (rc != SQLITE_OK)
     goto dberr;
   rc = sqlite3_bind_text(st, 1, sess->hostname, 
                          strlen(sess->hostname), SQLITE_STATIC);
   if (rc != SQLITE_OK)
     goto dberr;
+  if (sqlite3_step(st) != SQLITE_ROW) {
+    send_nokeys(sess, names != NULL);
+    no_send=1;
+    goto freeall;
+  }
+  sql_finish(st);
+  st=NULL;
+
+  /* with a download journal, this is a read-only transaction */
+  if (download_journal_count <= 0) {
+    if (sql_begin_trans(sess))
+      goto dberrnomsg;
+    dbaction=-1;
+  }
+  
+  /* all of the host's keys, grouped by principal */
+  rc = sql_prepare(sess,
+                   "SELECT principals.id, principals.name, kvno, enctype, key, acl.host FROM acl JOIN principals ON principals.id = acl.principal LEFT JOIN keys ON keys.principal = acl.principal WHERE acl.host = (SELECT id FROM hosts WHERE name = ?) ORDER BY acl.principal",
+                   &st);
 
-  rc = sqlite3_prepare_v2(sess->dbh, 
-			  "UPDATE acl SET attempted = 1 WHERE principal = ? AND hostname = ?;",
-			  -1, &updatt, NULL);
   if (rc != SQLITE_OK)
     goto dberr;
-  rc = sqlite3_bind_text(updatt, 2, sess->hostname, 
+  rc = sqlite3_bind_text(st, 1, sess->hostname, 
                          strlen(sess->hostname), SQLITE_STATIC);
   if (rc != SQLITE_OK)
     goto dberr;
 
-  rc = sqlite3_prepare_v2(sess->dbh, 
-			  "UPDATE principals SET downloadcount = downloadcount +1 WHERE id = ?;",
-			  -1, &updcount, NULL);
-  if (rc != SQLITE_OK)
-    goto dberr;
+  if (download_journal_count <= 0) {
+    rc = sql_prepare(sess,
+                     "UPDATE acl SET attempted = 1 WHERE principal = ? AND host = (SELECT id FROM hosts WHERE name = ?);",
+                     &updatt);
+    if (rc != SQLITE_OK)
+      goto dberr;
+    rc = sqlite3_bind_text(updatt, 2, sess->hostname, 
+                           strlen(sess->hostname), SQLITE_STATIC);
+    if (rc != SQLITE_OK)
+      goto dberr;
+
+    rc = sql_prepare(sess,
+                     "UPDATE principals SET downloadcount = downloadcount +1 WHERE id = ?;",
+                     &updcount);
+    if (rc != SQLITE_OK)
+      goto dberr;
+  }
 
   m=0;
+  nk=0;
   if (buf_setlength(buf, 4)) /* key count filled in later */
       goto memerr;
   set_cursor(buf, 4);
   
   while (SQLITE_ROW == sqlite3_step(st)) {
     principal=sqlite3_column_int64(st, 0);
-    pname = (const char *)sqlite3_column_text(st, 1);
-    kvno = sqlite3_column_int(st, 2);
-    if (pname == NULL || strlen(pname) == 0)
-      goto interr;
-    if (!strcmp(pname, "0") || 
-	principal == 0)
+    if (principal == 0)
       goto dberr;
+    if (principal != current) {
+      if (current && !skip && end_keyset(buf, last, nk))
+        goto interr;
+      current = principal;
+      pname = (const char *)sqlite3_column_text(st, 1);
+      kvno = sqlite3_column_int(st, 2);
+      if (pname == NULL || strlen(pname) == 0)
+        goto interr;
+      if (!strcmp(pname, "0"))
+        goto dberr;
 
-    if (names) {
-      for (i=0;i<n;i++)
-        if (!strcmp(pname, names[i]))
-          break;
       /* don't send this one */
-      if (i >= n)
+      skip = names &&
+        !bsearch(&pname, names, n, sizeof(char *), compare_names);
+      if (skip)
         continue;
-    }
 
-    if (buf_appendstring(buf, pname) || 
-	buf_appendint(buf, kvno))
-      goto memerr;
-    if (add_keys_one(sess, principal, buf))
-      goto freeall;
-
-    m++;
+      if (buf_appendstring(buf, pname) || 
+          buf_appendint(buf, kvno))
+        goto memerr;
+      last = get_cursor(buf); /* key count goes here */
+      if (buf_appendint(buf, 0))
+        goto memerr;
+      nk=0;
+      m++;
 
-    rc = sqlite3_bind_int64(updatt, 1, principal);
-    if (rc != SQLITE_OK)
-      goto dberr;
-    sqlite3_step(updatt);    
-    rc = sqlite3_reset(updatt);
-    if (rc != SQLITE_OK)
-      goto dberr;
+      if (download_journal_count > 0) {
+        if (sql_log_download(sess, principal, sqlite3_column_int64(st, 5),
+                             kvno))
+          goto interr;
+      } else {
+        rc = sqlite3_bind_int64(updatt, 1, principal);
+        if (rc != SQLITE_OK)
+          goto dberr;
+        sqlite3_step(updatt);    
+        rc = sqlite3_reset(updatt);
+        if (rc != SQLITE_OK)
+          goto dberr;
+
+        rc = sqlite3_bind_int64(updcount, 1, principal);
+        if (rc != SQLITE_OK)
+          goto dberr;
+        sqlite3_step(updcount);    
+        rc = sqlite3_reset(updcount);
+        if (rc != SQLITE_OK)
+          goto dberr;
+      }
+    } else if (skip) {
+      continue;
+    }
 
-    rc = sqlite3_bind_int64(updcount, 1, principal);
-    if (rc != SQLITE_OK)
-      goto dberr;
-    sqlite3_step(updcount);    
-    rc = sqlite3_reset(updcount);
-    if (rc != SQLITE_OK)
+    enctype = sqlite3_column_int(st, 3);
+    key = sqlite3_column_blob(st, 4);
+    l = sqlite3_column_bytes(st, 4);
+    if (key == NULL || l == 0)
+      goto interr;
+    if (enctype == 0)
       goto dberr;
+    if ((k = append_key(buf, enctype, key, l)) == 0)
+      goto memerr;
+    nk += k;
   }
+  if (current && !skip && end_keyset(buf, last, nk))
+    goto interr;
   if (m == 0) {
-    if (names)
-      send_error(sess, ERR_NOKEYS, "None of the requested keys are available for this host");
-    else
-      send_error(sess, ERR_NOKEYS, "No keys available for this host");
-    prtmsg("getnewkeys: No applicable keys available");
+    send_nokeys(sess, names != NULL);
     no_send=1;
   } else {
     set_cursor(buf, 0);
     if (buf_putint(buf, m))
       goto interr;
     sess_send(sess, RESP_KEYS, buf);
-    dbaction=1;
+    if (dbaction)
+      dbaction=1;
     no_send=1;
   }    
   
@@ -1467,11 +1716,11 @@ static void s_getkeys(struct rekey_session *sess, mb_t buf)
   no_send = 1;
  freeall:
   if (st)
-    sqlite3_finalize(st);
+    sql_finish(st);
   if (updatt)
-    sqlite3_finalize(updatt);
+    sql_finish(updatt);
   if (updcount)
-    sqlite3_finalize(updcount);
+    sql_finish(updcount);
   if (dbaction > 0) {
     if (sql_commit_trans(sess)) {
       sql_rollback_trans(sess);
@@ -1480,6 +1729,8 @@ static void s_getkeys(struct rekey_session *sess, mb_t buf)
     }
   } else if (dbaction < 0)
     sql_rollback_trans(sess);
+  if (sess->dbh)
+    sql_flush_downloads(sess, 0);
   if (names) {
     for (i=0;i<n;i++)
       free(names[i]);
@@ -1543,9 +1794,8 @@ static void s_commitkey(struct rekey_session *sess, mb_t buf)
   if (sql_init(sess))
     goto dberrnomsg;
 
-  rc = sqlite3_prepare_v2(sess->dbh, 
-                          "SELECT id from principals where name=? and kvno = ?",
-                          -1, &getprinc, NULL);
+  rc = sql_prepare(sess, "SELECT id from principals where name=? and kvno = ?",
+                   &getprinc);
   if (rc != SQLITE_OK)
     goto dberr;
   rc = sqlite3_bind_text(getprinc, 1, principal, strlen(principal), SQLITE_STATIC);
@@ -1562,7 +1812,7 @@ static void s_commitkey(struct rekey_session *sess, mb_t buf)
       goto dberr;
     match++;
   }
-  rc = sqlite3_finalize(getprinc);
+  rc = sql_finish(getprinc);
   getprinc=NULL;
   if (rc != SQLITE_OK)
     goto dberr;
@@ -1577,8 +1827,9 @@ static void s_commitkey(struct rekey_session *sess, mb_t buf)
     if (sql_begin_trans(sess))
       goto dberr;
     dbaction = -1;
-    rc = sqlite3_prepare(sess->dbh,"SELECT attempted FROM acl WHERE hostname=? AND principal=?",
-			 -1, &aclchk, NULL);
+    rc = sql_prepare(sess,
+                     "SELECT attempted FROM acl WHERE host=(SELECT id FROM hosts WHERE name=?) AND principal=?",
+                     &aclchk);
     
     if (rc != SQLITE_OK)
       goto dberr;
@@ -1597,7 +1848,7 @@ static void s_commitkey(struct rekey_session *sess, mb_t buf)
       goto freeall;
     }   
     downloaded = sqlite3_column_int64(aclchk, 0);
-    sqlite3_finalize(aclchk);
+    sql_finish(aclchk);
     aclchk=NULL;
     if (downloaded == 0) {
       send_error(sess, ERR_AUTHZ, "You are not allowed to update this principal");
@@ -1607,9 +1858,9 @@ static void s_commitkey(struct rekey_session *sess, mb_t buf)
       
     }
 
-    rc = sqlite3_prepare_v2(sess->dbh, 
-                            "UPDATE acl SET completed = 1 WHERE principal = ? AND hostname = ?;",
-                            -1, &updcomp, NULL);
+    rc = sql_prepare(sess,
+                     "UPDATE acl SET completed = 1 WHERE principal = ? AND host = (SELECT id FROM hosts WHERE name = ?);",
+                     &updcomp);
     if (rc != SQLITE_OK)
       goto dberr;
     rc = sqlite3_bind_int64(updcomp, 1, princid);
@@ -1620,21 +1871,21 @@ static void s_commitkey(struct rekey_session *sess, mb_t buf)
     if (rc != SQLITE_OK)
       goto dberr;
     sqlite3_step(updcomp);
-    rc = sqlite3_finalize(updcomp);
+    rc = sql_finish(updcomp);
     updcomp=NULL;
     if (rc != SQLITE_OK)
       goto dberr;
 
-    rc = sqlite3_prepare_v2(sess->dbh, 
-                            "UPDATE principals SET commitcount = commitcount +1 WHERE id = ?;",
-                            -1, &updcount, NULL);
+    rc = sql_prepare(sess,
+                     "UPDATE principals SET commitcount = commitcount +1 WHERE id = ?;",
+                     &updcount);
     if (rc != SQLITE_OK)
       goto dberr;
     rc = sqlite3_bind_int64(updcount, 1, princid);
     if (rc != SQLITE_OK)
       goto dberr;
     sqlite3_step(updcount);
-    rc = sqlite3_finalize(updcount);
+    rc = sql_finish(updcount);
     updcount=NULL;
     if (rc != SQLITE_OK)
       goto dberr;
@@ -1670,7 +1921,13 @@ static void s_commitkey(struct rekey_session *sess, mb_t buf)
   if (match)
     goto freeall;
 
-  do_finalize_req(sess, no_send, principal, princid, target, kvno);
+  /* The host has already been told its commit succeeded, so a refusal
+     here would go unseen and leave the request unfinalized.  This is
+     not limited; there is at most one per request. */
+  if (do_finalize_req(sess, no_send, NULL, principal, princid, target, kvno)) {
+    prtmsg("Finalizing %s after the last commit failed; it must be finalized by hand", principal);
+    kadm_release(sess, 1);
+  }
   goto freeall;
  dberr:
   prtmsg("database error: %s", sqlite3_errmsg(sess->dbh));
@@ -1688,13 +1945,13 @@ static void s_commitkey(struct rekey_session *sess, mb_t buf)
   no_send = 1;
  freeall:
   if (getprinc)
-    sqlite3_finalize(getprinc);
+    sql_finish(getprinc);
   if (aclchk)
-    sqlite3_finalize(aclchk);
+    sql_finish(aclchk);
   if (updcomp)
-    sqlite3_finalize(updcomp);
+    sql_finish(updcomp);
   if (updcount)
-    sqlite3_finalize(updcount);
+    sql_finish(updcount);
   if (dbaction > 0) {
     if (sql_commit_trans(sess)) {
       sql_rollback_trans(sess);
@@ -1703,6 +1960,7 @@ static void s_commitkey(struct rekey_session *sess, mb_t buf)
     }
   } else if (dbaction < 0)
     sql_rollback_trans(sess);
+  kadm_release(sess, 0);
   if (target)
     krb5_free_principal(sess->kctx, target);  
   free(principal);
@@ -1770,6 +2028,11 @@ static void s_simplekey(struct rekey_session *sess, mb_t buf)
   if (sql_init(sess))
     goto dberrnomsg;
 
+  if (kadm_limit_enter(sess)) {
+    send_error(sess, ERR_BUSY, KADM_BUSY_MSG);
+    no_send = 1;
+    goto freeall;
+  }
   if (sql_begin_trans(sess))
     goto dberrnomsg;
   dbaction=-1;
@@ -1813,6 +2076,7 @@ static void s_simplekey(struct rekey_session *sess, mb_t buf)
     }
   } else if (dbaction < 0)
     sql_rollback_trans(sess);
+  kadm_limit_leave(sess);
 
   if (target)
     krb5_free_principal(sess->kctx, target);
@@ -1824,8 +2088,12 @@ static void s_abortreq(struct rekey_session *sess, mb_t buf)
 {
   char *principal = NULL, *unp;
   sqlite_int64 princid;
-  int rc, match;
+  int rc, match, dbaction=0, kadmerr=0;
   krb5_principal target=NULL;
+  kadm5_principal_ent_rec ke;
+  krb5_flags attributes;
+  struct timeval start;
+
 
   if (buf_getstring(buf, &principal, malloc))
     goto badpkt;
@@ -1862,6 +2130,9 @@ static void s_abortreq(struct rekey_session *sess, mb_t buf)
  
   if (sql_init(sess))
     goto dberrnomsg;
+  if (sql_begin_trans(sess))
+    goto dberrnomsg;
+  dbaction=-1;
 
   match = find_principal(sess, principal, &princid, NULL);
   if (match < 0)
@@ -1871,8 +2142,45 @@ static void s_abortreq(struct rekey_session *sess, mb_t buf)
     send_error(sess, ERR_NOTFOUND, "Requested principal does not have rekey in progress");
     goto freeall;
   }
-  do_purge(sess, princid);
+  if (do_purge(sess, princid) != SQLITE_OK)
+    goto dberr;
+  if (sql_commit_trans(sess))
+    goto dberr;
+  dbaction=0;
   sess_send(sess, RESP_OK, NULL);  
+
+  /* If the aborted request created the principal, it is still locked
+     and has only random keys.  Unlock it, so it is left as if it had
+     been created by hand. */
+  if (kadm_init(sess)) {
+    prtmsg("Cannot check whether %s is locked; it may need to be unlocked with kadmin", principal);
+    goto freeall;
+  }
+  memset(&ke, 0, sizeof(ke));
+  gettimeofday(&start, NULL);
+  rc = kadm5_get_principal(sess->kadm_handle, target, &ke, 
+                           KADM5_ATTRIBUTES);
+  kadm_timing(sess, "get_principal", &start);
+  if (rc == KADM5_UNK_PRINC)
+    goto freeall;
+  if (rc) {
+    prtmsg("Cannot check whether %s is locked; it may need to be unlocked with kadmin: %s",
+           principal, krb5_get_err_text(sess->kctx, rc));
+    kadmerr = 1;
+    goto freeall;
+  }
+  attributes = ke.attributes;
+  kadm5_free_principal_ent(sess->kadm_handle, &ke);
+  if ((attributes & KRB5_KDB_NEW_PRINC) == 0)
+    goto freeall;
+  rc = unlock_new_principal(sess, target, attributes);
+  if (rc) {
+    prtmsg("Unlocking new principal %s failed; it is still disabled and must be unlocked with kadmin: %s",
+           principal, krb5_get_err_text(sess->kctx, rc));
+    kadmerr = 1;
+    goto freeall;
+  }
+  prtmsg("Unlocked new principal %s", principal);
   goto freeall;
  dberr:
   prtmsg("database error: %s", sqlite3_errmsg(sess->dbh));
@@ -1885,25 +2193,29 @@ static void s_abortreq(struct rekey_session *sess, mb_t buf)
  badpkt:
   send_error(sess, ERR_BADREQ, "Packet was corrupt or too short");
  freeall:  
+  if (dbaction < 0)
+    sql_rollback_trans(sess);
+  kadm_release(sess, kadmerr);
   if (target)
     krb5_free_principal(sess->kctx, target);
   free(principal);
 }
 
-static void s_finalize(struct rekey_session *sess, mb_t buf)
+/* Finalize one principal's rekey.  Returns 0 on success; on failure,
+   *res says why. */
+static int finalize_one(struct rekey_session *sess, char *principal,
+                        struct op_result *res)
 {
-  char *principal = NULL, *unp;
+  char *unp;
   sqlite_int64 princid;
-  int rc, match;
+  int rc, match, ret=1;
   krb5_kvno kvno;
   krb5_principal target=NULL;
 
-  if (buf_getstring(buf, &principal, malloc))
-    goto badpkt;
   rc = krb5_parse_name(sess->kctx, principal, &target);
   if (rc) {
     prtmsg("Cannot parse target name %s (kerberos error %s)", principal, krb5_get_err_text(sess->kctx, rc));
-    send_error(sess, ERR_BADREQ, "Bad principal name");
+    finalize_fail(sess, 0, res, ERR_BADREQ, "Bad principal name");
     goto freeall;
   }
 
@@ -1914,7 +2226,7 @@ static void s_finalize(struct rekey_session *sess, mb_t buf)
   } 
   if (strcmp(unp, principal)) {
     free_unparsed_name(sess->kctx, unp);
-    send_error(sess, ERR_BADREQ, "Bad principal name (it is not canonical; missing realm?)");
+    finalize_fail(sess, 0, res, ERR_BADREQ, "Bad principal name (it is not canonical; missing realm?)");
     prtmsg("Requested principal %s is not canonical", principal);
     goto freeall;
   }
@@ -1923,22 +2235,19 @@ static void s_finalize(struct rekey_session *sess, mb_t buf)
       !krb5_principal_compare(sess->kctx,
                               sess->princ,
                               target)) {
-    send_error(sess, ERR_AUTHZ, "Not authorized (must authenticate as an administrator or the target)");
+    finalize_fail(sess, 0, res, ERR_AUTHZ, "Not authorized (must authenticate as an administrator or the target)");
     prtmsg("Not authorized to finalize");
     goto freeall;
   }
 
   prtmsg("Immediate commit/finalize of %s", principal);
 
-  if (sql_init(sess))
-    goto dberrnomsg;
-
   match = find_principal(sess, principal, &princid, &kvno);
   if (match < 0)
     goto dberr;
 
   if (match == 0) {
-    send_error(sess, ERR_NOTFOUND, "Requested principal does not have rekey in progress");
+    finalize_fail(sess, 0, res, ERR_NOTFOUND, "Requested principal does not have rekey in progress");
     goto freeall;
   }
 
@@ -1948,37 +2257,120 @@ static void s_finalize(struct rekey_session *sess, mb_t buf)
   
   /* not done yet */
   if (match) {
-    send_error(sess, ERR_OTHER, "Request is not ready to be finalized");
+    finalize_fail(sess, 0, res, ERR_OTHER, "Request is not ready to be finalized");
     goto freeall;
   } 
 
-  if (do_finalize_req(sess, 0, principal, princid, target, kvno))
+  if (kadm_limit_enter(sess)) {
+    finalize_fail(sess, 0, res, ERR_BUSY, KADM_BUSY_MSG);
     goto freeall;
-  sess_send(sess, RESP_OK, NULL);
+  }
+  if (do_finalize_req(sess, 0, res, principal, princid, target, kvno)) {
+    kadm_release(sess, 1);
+    goto freeall;
+  }
+  ret = 0;
   goto freeall;
  dberr:
   prtmsg("database error: %s", sqlite3_errmsg(sess->dbh));
- dberrnomsg:
-  send_error(sess, ERR_OTHER, "Server internal error (database failure)");
+  finalize_fail(sess, 0, res, ERR_OTHER, "Server internal error (database failure)");
   goto freeall;
  interr:
-  send_error(sess, ERR_OTHER, "Server internal error");
-  goto freeall;
- badpkt:
-  send_error(sess, ERR_BADREQ, "Packet was corrupt or too short");
+  finalize_fail(sess, 0, res, ERR_OTHER, "Server internal error");
  freeall:  
   if (target)
     krb5_free_principal(sess->kctx, target);  
+  return ret;
+}
+
+static void s_finalize(struct rekey_session *sess, mb_t buf)
+{
+  char *principal = NULL;
+  struct op_result res;
+
+  if (buf_getstring(buf, &principal, malloc)) {
+    send_error(sess, ERR_BADREQ, "Packet was corrupt or too short");
+    return;
+  }
+  if (sql_init(sess)) {
+    send_error(sess, ERR_OTHER, "Server internal error (database failure)");
+    goto freeall;
+  }
+  if (finalize_one(sess, principal, &res))
+    send_error(sess, res.code, res.msg);
+  else
+    sess_send(sess, RESP_OK, NULL);
+ freeall:
+  kadm_release(sess, 0);
   free(principal);
 }
 
+/* process a FINALIZEMANY request.  Each principal is finalized in turn,
+   using the same database and kadm5 handles, and the outcome for each
+   is returned in a RESULTS response */
+static void s_finalizemany(struct rekey_session *sess, mb_t buf)
+{
+  char **names=NULL;
+  unsigned int i, n=0, ok=0;
+  struct op_result res;
+
+  if (buf_getint(buf, &n))
+    goto badpkt;
+  /* each name takes at least 4 bytes */
+  if (n > buf->length / 4)
+    goto badpkt;
+  names=calloc(n ? n : 1, sizeof(char *));
+  if (!names)
+    goto memerr;
+  for (i=0;i<n;i++) {
+    if (buf_getstring(buf, &names[i], malloc))
+      goto badpkt;
+  }
+  prtmsg("Finalize %d principals", n);
+
+  if (sql_init(sess)) {
+    send_error(sess, ERR_OTHER, "Server internal error (database failure)");
+    goto freeall;
+  }
+
+  buf_setlength(buf, 0);
+  if (buf_appendint(buf, n))
+    goto memerr;
+  for (i=0;i<n;i++) {
+    if (finalize_one(sess, names[i], &res) == 0) {
+      res.code = 0;
+      res.msg = "";
+      ok++;
+    }
+    if (buf_appendstring(buf, names[i]) || buf_appendint(buf, res.code) ||
+        buf_appendstring(buf, res.msg))
+      goto memerr;
+  }
+  prtmsg("Finalized %d of %d principals", ok, n);
+  sess_send(sess, RESP_RESULTS, buf);
+  goto freeall;
+ memerr:
+  send_error(sess, ERR_OTHER, "Server internal error (out of memory)");
+  goto freeall;
+ badpkt:
+  send_error(sess, ERR_BADREQ, "Packet was corrupt or too short");
+ freeall:
+  kadm_release(sess, 0);
+  if (names) {
+    for (i=0;i<n;i++)
+      free(names[i]);
+    free(names);
+  }
+}
+
 static void s_delprinc(struct rekey_session *sess, mb_t buf)
 {
   char *principal = NULL, *unp;
   sqlite_int64 princid;
-  int rc, match;
+  int rc, match, dbaction=0;
   krb5_kvno kvno;
   krb5_principal target=NULL;
+  struct timeval start;
 
   if (sess->is_admin == 0) {
     send_error(sess, ERR_AUTHZ, "Not authorized (you must be an administrator)");
@@ -2012,6 +2404,14 @@ static void s_delprinc(struct rekey_session *sess, mb_t buf)
 
   if (sql_init(sess))
     goto dberrnomsg;
+  if (kadm_limit_enter(sess)) {
+    send_error(sess, ERR_BUSY, KADM_BUSY_MSG);
+    goto freeall;
+  }
+  /* hold the write lock, so a rekey cannot be started meanwhile */
+  if (sql_begin_trans(sess))
+    goto dberrnomsg;
+  dbaction=-1;
 
   match = find_principal(sess, principal, &princid, &kvno);
   if (match < 0)
@@ -2023,7 +2423,9 @@ static void s_delprinc(struct rekey_session *sess, mb_t buf)
   }
   if (kadm_init(sess))
     goto interr;
+  gettimeofday(&start, NULL);
   rc = kadm5_delete_principal(sess->kadm_handle, target);
+  kadm_timing(sess, "delete_principal", &start);
   if (rc) {
     if (rc == KADM5_UNK_PRINC) {
       prtmsg("Principal %s does not exist", principal);
@@ -2032,6 +2434,7 @@ static void s_delprinc(struct rekey_session *sess, mb_t buf)
     }
     prtmsg("Unable to lookup principal %s: %s", principal, 
 	   krb5_get_err_text(sess->kctx, rc));
+    kadm_release(sess, 1);
     goto interr;
   }
   sess_send(sess, RESP_OK, NULL);
@@ -2047,6 +2450,9 @@ static void s_delprinc(struct rekey_session *sess, mb_t buf)
  badpkt:
   send_error(sess, ERR_BADREQ, "Packet was corrupt or too short");
  freeall:  
+  if (dbaction < 0)
+    sql_rollback_trans(sess);
+  kadm_release(sess, 0);
   if (target)
     krb5_free_principal(sess->kctx, target);  
   free(principal);
@@ -2063,60 +2469,159 @@ static void (*func_table[])(struct rekey_session *, mb_t) = {
   s_simplekey,
   s_abortreq,
   s_finalize,
-  s_delprinc
+  s_delprinc,
+  s_finalizemany,
+  NULL  /* OP_TAGGED is handled by sess_dispatch */
 };
 
-void run_session(int s) {
+static void worker_init(void) 
+{
+  struct rekey_session tmp;
+
+  if (worker_kctx)
+    return;
+  if (krb5_init_context(&worker_kctx))
+    fatal("krb5_init_context failed");
+  memset(&tmp, 0, sizeof(tmp));
+  tmp.kctx = worker_kctx;
+  if (target_acl_path)
+    worker_target_file = acl_file_load(&tmp, target_acl_path);
+  else if (!access(REKEY_TARGET_ACL, F_OK))
+    worker_target_file = acl_file_load(&tmp, REKEY_TARGET_ACL);
+  else
+    worker_target_acl = acl_load_builtin(&tmp, "<builtin target ACL>",
+                                         builtin_target_acl);
+  if (worker_target_file && !acl_file_current(worker_target_file))
+    fatal("Cannot load target ACL");
+}
+
+/* Set up the per-process state before any sessions are started, so that
+   processes forked to serve them inherit it rather than each building
+   their own. */
+void sess_startup(void) 
+{
+  worker_init();
+  acceptor_cred();
+}
+
+/* Set up a new session on an SSL connection that has not yet completed
+   its handshake */
+void sess_init(struct rekey_session *sess, SSL *ssl) 
+{
+  worker_init();
+  memset(sess, 0, sizeof(*sess));
+  sess->ssl = ssl;
+  sess->kctx = worker_kctx;
+  sess->initialized=1;
+  sess->state = REKEY_SESSION_LISTENING;
+}
+
+/* Unwrap a TAGGED request, leaving the request it carries in buf.  The
+   reply will be tagged by sess_send.  Returns the inner opcode, or 0 if
+   an error has already been sent. */
+static int untag_request(struct rekey_session *sess, mb_t buf) 
+{
+  unsigned char opc;
+  size_t len;
+
+  if (buf_getint(buf, &sess->tag) || buf_getdata(buf, &opc, 1)) {
+    send_error(sess, ERR_BADREQ, "Packet was corrupt or too short");
+    return 0;
+  }
+  sess->tagged = 1;
+  len = buf->length - get_cursor(buf);
+  memmove(buf->value, buf->cursor, len);
+  buf_setlength(buf, len);
+  if (opc <= OP_AUTHCHAN || opc == OP_TAGGED) {
+    send_error(sess, ERR_BADOP, "Function code not allowed in a tagged request");
+    return 0;
+  }
+  return opc;
+}
+
+/* Process one request, which has already been read into buf.  On return,
+   a reply has been sent (or queued) and the session is ready for the next
+   request. */
+void sess_dispatch(struct rekey_session *sess, int opcode, mb_t buf) 
+{
+  if (sess->authstate != 2 && opcode > 3) {
+    send_error(sess, ERR_AUTHZ, "Operation not allowed on unauthenticated connection");
+  } else if (opcode <= 0 || opcode > MAX_OPCODE) {
+    send_error(sess, ERR_BADOP, "Function code was out of range");
+  } else if (opcode == OP_TAGGED && !(opcode = untag_request(sess, buf))) {
+    /* error already sent */
+  } else if (opcode > MAX_OPCODE) {
+    send_error(sess, ERR_BADOP, "Function code was out of range");
+  } else {
+    func_table[opcode](sess, buf);
+    if (sess->initialized == 0)
+      fatal("session terminated during operation %d, but handler did not exit", opcode);
+    if (sess->state != REKEY_SESSION_IDLE) {
+      send_error(sess, ERR_OTHER, "Internal error in server");
+      prtmsg("Handler for %d did not send a reply", opcode);
+    }
+  }
+  sess->tagged = 0;
+  sess->state = REKEY_SESSION_LISTENING;
+}
+
+/* If standalone is set, this process will never accept another connection,
+   so the listening sockets are closed and the process exits when the
+   connection closes.  Otherwise, return to the caller. */
+static void session_main(int s, int standalone) {
   struct rekey_session sess;
   mb_t buf;
+  SSL *ssl;
   int opcode;
 
-  memset(&sess, 0, sizeof(sess));
   buf = buf_alloc(1);
   if (!buf) {
     close(s);
     fatal("Cannot allocate memory: %s", strerror(errno));
   }
-  sess.ssl = do_ssl_accept(s);
-  child_cleanup();
+  ssl = do_ssl_accept(s);
+  if (standalone)
+    child_cleanup();
+  sess_init(&sess, ssl);
+  /* a deadline may shut the socket down under a write */
+  signal(SIGPIPE, SIG_IGN);
 
-  if (krb5_init_context(&sess.kctx))
-    fatal("krb5_init_context failed");
-  if (target_acl_path)
-    sess.target_acl = acl_load(&sess, target_acl_path);
-  else if (!access(REKEY_TARGET_ACL, F_OK))
-    sess.target_acl = acl_load(&sess, REKEY_TARGET_ACL);
-  else
-    sess.target_acl = acl_load_builtin(&sess, "<builtin target ACL>",
-                                       builtin_target_acl);
-
-  sess.db_lock = -1;
-  sess.initialized=1;
-  sess.state = REKEY_SESSION_LISTENING;
   for (;;) {
-    opcode = sess_recv(&sess, buf);
+    if (idle_timeout && !SSL_pending(ssl)) {
+      struct pollfd pfd;
+      int rc;
+
+      pfd.fd = s;
+      pfd.events = POLLIN;
+      do {
+        rc = poll(&pfd, 1, idle_timeout * 1000);
+      } while (rc < 0 && errno == EINTR);
+      if (rc == 0) {
+        prtmsg("Closing idle session after %d seconds", idle_timeout);
+        opcode = -1;
+      } else {
+        opcode = sess_recv(&sess, buf);
+      }
+    } else {
+      opcode = sess_recv(&sess, buf);
+    }
     
     if (opcode == -1) {
       sess_finalize(&sess);
+      buf_free(buf);
+      if (!standalone)
+        return;
       ssl_cleanup();
       fatal("Connection closed");
     }
-    if (sess.authstate != 2 && opcode > 3) {
-      send_error(&sess, ERR_AUTHZ, "Operation not allowed on unauthenticated connection");
-      continue;
-    }
-    
-    if (opcode <= 0 || opcode > MAX_OPCODE) {
-       send_error(&sess, ERR_BADOP, "Function code was out of range");
-    } else {
-      func_table[opcode](&sess, buf);
-      if (sess.initialized == 0)
-        fatal("session terminated during operation %d, but handler did not exit", opcode);
-      if (sess.state != REKEY_SESSION_IDLE) {
-        send_error(&sess, ERR_OTHER, "Internal error in server");
-        prtmsg("Handler for %d did not send a reply", opcode);
-      }
-      sess.state = REKEY_SESSION_LISTENING;
-    }
+    sess_dispatch(&sess, opcode, buf);
   }
 }
+
+void run_session(int s) {
+  session_main(s, 1);
+}
+
+void serve_session(int s) {
+  session_main(s, 0);
+}
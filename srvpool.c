@@ -0,0 +1,299 @@
+/*
+ * Copyright (c) 2008-2009, 2013 Carnegie Mellon University.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer. 
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * 3. The name "Carnegie Mellon University" must not be used to
+ *    endorse or promote products derived from this software without
+ *    prior written permission. For permission or any other legal
+ *    details, please contact  
+ *      Office of Technology Transfer
+ *      Carnegie Mellon University
+ *      5000 Forbes Avenue
+ *      Pittsburgh, PA  15213-3890
+ *      (412) 268-4387, fax: (412) 268-7395
+ *      tech-transfer@andrew.cmu.edu
+ *
+ * 4. Redistributions of any form whatsoever must retain the following
+ *    acknowledgment:
+ *    "This product includes software developed by Computing Services
+ *     at Carnegie Mellon University (http://www.cmu.edu/computing/)."
+ *
+ * CARNEGIE MELLON UNIVERSITY DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS, IN NO EVENT SHALL CARNEGIE MELLON UNIVERSITY BE LIABLE
+ * FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdarg.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syslog.h>
+#include <sys/wait.h>
+
+#include "rekeysrv-locl.h"
+
+#if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+/* pool_max_workers == 0 means fork a new child for every connection */
+int pool_min_workers = 0;
+int pool_max_workers = 0;
+int pool_max_requests = 0;
+
+/*
+ * The scoreboard lives in anonymous shared memory so that the master can
+ * see which workers are busy.  Each worker only ever writes its own slot;
+ * the master writes pid and retire.  Workers which do their own admission
+ * control (-R listeners, event-driven workers) also publish their session
+ * counts there, so that -M and -q limit the whole server.
+ */
+struct worker_slot {
+  pid_t pid;
+  volatile int busy;
+  volatile int retire;
+  volatile int sessions;
+  volatile int held;
+};
+
+static struct worker_slot *scoreboard;
+static struct worker_slot *my_slot;
+static pid_t master_pid;
+static volatile sig_atomic_t pool_shutdown;
+
+static void pool_sigterm(int sig) {
+  pool_shutdown = 1;
+}
+
+static volatile sig_atomic_t pool_reload;
+
+static void pool_sighup(int sig) {
+  pool_reload = 1;
+}
+
+/* SIGCHLD only needs to interrupt the master's poll(); reaping is done
+   synchronously in reap_workers() */
+static void pool_sigchld(int sig) {
+}
+
+static int worker_done(void) 
+{
+  return my_slot->retire || getppid() != master_pid;
+}
+
+static int listener_tick(void) 
+{
+  if (max_sessions)
+    admission_tick();
+  return worker_done();
+}
+
+/*
+ * Publish this process's count of sessions being served and connections
+ * held, and return the number of sessions across the whole pool (and the
+ * number held in *total_held, if not NULL).  Outside a pool, the counts
+ * are just the caller's.  Two workers checking at once may both admit a
+ * connection, so the limits can be exceeded briefly by a few sessions.
+ */
+int pool_sessions(int sessions, int held, int *total_held) 
+{
+  int i, total = 0;
+
+  if (!my_slot) {
+    if (total_held)
+      *total_held = held;
+    return sessions;
+  }
+  my_slot->sessions = sessions;
+  my_slot->held = held;
+  if (total_held)
+    *total_held = 0;
+  for (i = 0; i < pool_max_workers; i++) {
+    total += scoreboard[i].sessions;
+    if (total_held)
+      *total_held += scoreboard[i].held;
+  }
+  return total;
+}
+
+static void worker_main(int slot) 
+{
+  struct worker_slot *me = &scoreboard[slot];
+  struct sockaddr_storage ss;
+  struct sockaddr *sa = (struct sockaddr *)&ss;
+  int s, nreq = 0;
+
+  my_slot = me;
+  signal(SIGTERM, SIG_DFL);
+  signal(SIGINT, SIG_DFL);
+  signal(SIGCHLD, SIG_DFL);
+  signal(SIGHUP, acl_sighup);
+
+  /* with -R, each worker owns its own listening sockets and runs its own
+     accept loop, forking per connection unless -e is also given */
+  if (listen_reuseport) {
+    net_startup();
+    if (!event_mode) {
+      admission_init();
+      run_accept_loop(run_one, listener_tick);
+      exit(0);
+    }
+  }
+
+  /* an event-driven worker serves many sessions at once, and is never
+     considered busy */
+  if (event_mode) {
+    run_event_loop(worker_done);
+    exit(0);
+  }
+
+  /* wake up once a second so that retirement and the death of the
+     master are noticed even when no connections are arriving */
+  while (!worker_done()) {
+    s = net_accept(sa, 1000);
+    if (s < 0)
+      continue;
+    me->busy = 1;
+    log_connection(sa);
+    serve_session(s);
+    close(s);
+    me->busy = 0;
+    if (pool_max_requests && ++nreq >= pool_max_requests)
+      break;
+  }
+  exit(0);
+}
+
+static int spawn_worker(int slot) 
+{
+  pid_t p;
+
+  memset(&scoreboard[slot], 0, sizeof(struct worker_slot));
+  p = fork();
+  if (p < 0) {
+    syslog(LOG_ERR, "Cannot fork: %m");
+    return 1;
+  }
+  if (p == 0)
+    worker_main(slot);
+  scoreboard[slot].pid = p;
+  return 0;
+}
+
+static void reap_workers(void) 
+{
+  pid_t p;
+  int i, status;
+
+  while ((p = waitpid(-1, &status, WNOHANG)) > 0) {
+    for (i = 0; i < pool_max_workers; i++) {
+      if (scoreboard[i].pid != p)
+        continue;
+      if (WIFSIGNALED(status))
+        syslog(LOG_ERR, "Worker %ld killed by signal %d", (long)p,
+               WTERMSIG(status));
+      /* its sessions no longer count against -M, even if some of its
+         children are still running */
+      memset(&scoreboard[i], 0, sizeof(struct worker_slot));
+      break;
+    }
+  }
+}
+
+/*
+ * Run the master side of the pre-forked worker pool.  Workers are started
+ * until pool_min_workers are running, and more are added (up to
+ * pool_max_workers) whenever none is idle.  Surplus idle workers are
+ * retired one at a time.  Returns after SIGTERM or SIGINT, once all
+ * workers have been told to exit.
+ */
+void run_worker_pool(void) 
+{
+  int i, total, idle, free_slot, victim;
+
+  scoreboard = mmap(NULL, pool_max_workers * sizeof(struct worker_slot),
+                    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS,
+                    -1, 0);
+  if (scoreboard == MAP_FAILED)
+    fatal("Cannot allocate worker scoreboard: %s", strerror(errno));
+  memset(scoreboard, 0, pool_max_workers * sizeof(struct worker_slot));
+  master_pid = getpid();
+
+  signal(SIGCHLD, pool_sigchld);
+  signal(SIGTERM, pool_sigterm);
+  signal(SIGINT, pool_sigterm);
+  signal(SIGHUP, pool_sighup);
+
+  while (!pool_shutdown) {
+    reap_workers();
+
+    /* pass SIGHUP on to the workers, and keep the master's copy of the
+       ACLs current so that new workers start with it */
+    if (pool_reload) {
+      pool_reload = 0;
+      acl_sighup(SIGHUP);
+      for (i = 0; i < pool_max_workers; i++)
+        if (scoreboard[i].pid)
+          kill(scoreboard[i].pid, SIGHUP);
+    }
+    acl_refresh_all();
+
+    total = idle = 0;
+    free_slot = victim = -1;
+    for (i = 0; i < pool_max_workers; i++) {
+      if (scoreboard[i].pid == 0) {
+        if (free_slot < 0)
+          free_slot = i;
+        continue;
+      }
+      if (scoreboard[i].retire)
+        continue;
+      total++;
+      if (!scoreboard[i].busy) {
+        idle++;
+        victim = i;
+      }
+    }
+
+    if (free_slot >= 0 && 
+        (total < pool_min_workers || (idle == 0 && total < pool_max_workers))) {
+      if (spawn_worker(free_slot) == 0)
+        continue;
+    } else if (idle > 1 && total > pool_min_workers) {
+      scoreboard[victim].retire = 1;
+    }
+    /* EINTR (SIGCHLD, SIGTERM) just means go around again */
+    poll(NULL, 0, 1000);
+  }
+
+  for (i = 0; i < pool_max_workers; i++)
+    scoreboard[i].retire = 1;
+  syslog(LOG_INFO, "Shutting down; workers will exit when idle");
+}
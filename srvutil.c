@@ -49,8 +49,11 @@
 #include <errno.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <time.h>
 #include <sys/types.h>
 #include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/time.h>
 #include <sys/socket.h>
 #include <sys/syslog.h>
 #include <netdb.h>
@@ -90,12 +93,18 @@ void sess_finalize(struct rekey_session *sess)
   OM_uint32 min;
   if (sess->state == REKEY_SESSION_SENDING)
     prtmsg("warning: session closed before reply sent");
+  /* a queued reply (typically from send_fatal) gets one chance to go out */
+  if (sess->ssl && sess->outq && sess->outq->length)
+    (void)SSL_write(sess->ssl, sess->outq->value, sess->outq->length);
   if (sess->ssl) {
+    if (!sess->outq)
+      set_io_deadline(SSL_get_fd(sess->ssl), request_timeout, "shutdown");
     SSL_shutdown(sess->ssl);
+    if (!sess->outq)
+      set_io_deadline(SSL_get_fd(sess->ssl), 0, NULL);
     SSL_free(sess->ssl);
   }
-  if (sess->kadm_handle)
-    kadm5_destroy(sess->kadm_handle);
+  kadm_release(sess, 0);
   if (sess->realm) {
 #if defined(HAVE_KRB5_REALM)
     krb5_xfree(sess->realm);
@@ -105,27 +114,59 @@ void sess_finalize(struct rekey_session *sess)
   }
   if (sess->princ)
     krb5_free_principal(sess->kctx, sess->princ);
-  if (sess->kctx)
-    krb5_free_context(sess->kctx);
+  /* sess->kctx belongs to the process, not the session */
   if (sess->gctx)
     (void)gss_delete_sec_context(&min, &sess->gctx, GSS_C_NO_BUFFER);
   if (sess->name)
     (void)gss_release_name(&min, &sess->name);
-  if (sess->dbh)
-    sqlite3_close(sess->dbh);
+  sql_release(sess);
+  if (sess->db_wait)
+    syslog(LOG_INFO, "Waited %ld ms for the database lock in %d transactions",
+           sess->db_wait, sess->db_trans);
+  if (sess->kadm_calls)
+    syslog(LOG_INFO, "Spent %ld ms in %d kadmin operations",
+           sess->kadm_time, sess->kadm_calls);
+  if (sess->kadm_wait)
+    syslog(LOG_INFO, "Waited %ld ms for the kadmin limiter", sess->kadm_wait);
   free(sess->hostname);
   free(sess->plain_name);
-  memset(&sess, 0, sizeof(sess));
+  free(sess->setup_name);
+  memset(sess, 0, sizeof(*sess));
 }
 
 void sess_send(struct rekey_session *sess, int opcode, mb_t buf) 
 {
+  mb_t tagbuf = NULL;
+  unsigned char opc;
+
   if (sess->state != REKEY_SESSION_SENDING) {
     prtmsg("Cannot send message (of type %d) while in state %d\n", opcode,
            sess->state);
     return;
   }
-  do_send(sess->ssl, opcode, buf);
+  /* the reply to a tagged request is wrapped in RESP_TAGGED */
+  if (sess->tagged) {
+    opc = opcode & 0xFF;
+    tagbuf = buf_alloc(5 + (buf ? buf->length : 0));
+    if (!tagbuf || buf_appendint(tagbuf, sess->tag) ||
+        buf_appenddata(tagbuf, &opc, 1) ||
+        (buf && buf->length &&
+         buf_appenddata(tagbuf, buf->value, buf->length)))
+      fatal("memory allocation failed: %s", strerror(errno));
+    opcode = RESP_TAGGED;
+    buf = tagbuf;
+  }
+  if (sess->outq) {
+    if (frame_append(sess->outq, opcode, buf))
+      fatal("memory allocation failed: %s", strerror(errno));
+  } else {
+    set_io_deadline(SSL_get_fd(sess->ssl), request_timeout,
+                    "reply to be sent");
+    do_send(sess->ssl, opcode, buf);
+    set_io_deadline(SSL_get_fd(sess->ssl), 0, NULL);
+  }
+  if (tagbuf)
+    buf_free(tagbuf);
   sess->state = REKEY_SESSION_IDLE;
 }
 
@@ -138,7 +179,9 @@ int sess_recv(struct rekey_session *sess, mb_t buf)
            sess->state);
     return -1;
   }
+  set_io_deadline(SSL_get_fd(sess->ssl), request_timeout, "request");
   ret = do_recv(sess->ssl, buf);
+  set_io_deadline(SSL_get_fd(sess->ssl), 0, NULL);
   if (ret > 0)
     sess->state = REKEY_SESSION_SENDING;
   return ret;
@@ -301,12 +344,37 @@ int krealm_init(struct rekey_session *sess) {
   return 0;
 }
 
+/*
+ * Setting up a kadm5 handle costs a keytab read, an AS exchange and a new
+ * connection to kadmind, so each process keeps the handle it last used
+ * and hands it to later sessions.  It is replaced after
+ * kadm_handle_lifetime seconds, well before its credentials expire, and
+ * thrown away whenever an operation using it fails, in case the
+ * connection is what failed.  A lifetime of 0 gives each session its own
+ * handle, as before.
+ */
+int kadm_handle_lifetime = 300;
+
+static void *proc_kadm_handle;
+static time_t proc_kadm_expires;
+
 int kadm_init(struct rekey_session *sess) 
 {
   void *kadm_handle=NULL;
   kadm5_config_params kadm_param;
+  struct timeval start;
   int rc;
 
+  if (sess->kadm_handle)
+    return 0;
+  if (proc_kadm_handle) {
+    if (time(0) < proc_kadm_expires) {
+      sess->kadm_handle = proc_kadm_handle;
+      return 0;
+    }
+    kadm5_destroy(proc_kadm_handle);
+    proc_kadm_handle = NULL;
+  }
   rc = krealm_init(sess);
   if (rc)
     return rc;
@@ -314,6 +382,7 @@ int kadm_init(struct rekey_session *sess)
   kadm_param.mask = KADM5_CONFIG_REALM;
   kadm_param.realm = sess->realm;
 
+  gettimeofday(&start, NULL);
 #ifdef HAVE_KADM5_INIT_WITH_SKEY_CTX
   rc = kadm5_init_with_skey_ctx(sess->kctx, "rekey/admin", NULL, KADM5_ADMIN_SERVICE,
 			    &kadm_param, KADM5_STRUCT_VERSION, 
@@ -323,24 +392,195 @@ int kadm_init(struct rekey_session *sess)
 			    &kadm_param, KADM5_STRUCT_VERSION, 
 			    KADM5_API_VERSION_2, NULL, &kadm_handle);
 #endif
+  kadm_timing(sess, "init", &start);
   if (rc) {
     prtmsg("Unable to initialize kadm5 library: %s", krb5_get_err_text(sess->kctx, rc));
     return rc;
   }
-   sess->kadm_handle = kadm_handle;
+  sess->kadm_handle = kadm_handle;
+  if (kadm_handle_lifetime > 0) {
+    proc_kadm_handle = kadm_handle;
+    proc_kadm_expires = time(0) + kadm_handle_lifetime;
+  }
   return 0;
 }
 
+/* Account for a kadm5 operation which began at <start> */
+void kadm_timing(struct rekey_session *sess, char *op, struct timeval *start)
+{
+  struct timeval end;
+  long elapsed;
+
+  gettimeofday(&end, NULL);
+  elapsed = (end.tv_sec - start->tv_sec) * 1000 +
+    (end.tv_usec - start->tv_usec) / 1000;
+  if (elapsed < 0)
+    elapsed = 0;
+  sess->kadm_calls++;
+  sess->kadm_time += elapsed;
+  syslog(LOG_DEBUG, "kadm5 %s took %ld ms", op, elapsed);
+}
+
+/* Give up the session's kadm5 handle, and its kadmin limiter slot.  If
+   <failed> is set, an operation using it went wrong, and it is not
+   reused. */
+void kadm_release(struct rekey_session *sess, int failed)
+{
+  kadm_limit_leave(sess);
+  if (!sess->kadm_handle)
+    return;
+  if (sess->kadm_handle == proc_kadm_handle) {
+    if (!failed) {
+      sess->kadm_handle = NULL;
+      return;
+    }
+    proc_kadm_handle = NULL;
+  }
+  kadm5_destroy(sess->kadm_handle);
+  sess->kadm_handle = NULL;
+}
+
 #include "sqlinit.h"
-int sql_init(struct rekey_session *sess) 
+
+/* the schema version recorded in the database's user_version */
+#define REKEY_SCHEMA_VERSION 2
+
+/*
+ * Statements which upgrade the database from one schema version to the
+ * next; sql_migrations[n] takes version n to n+1.  Afterward, the current
+ * schema from rekey.sql is applied to create anything new.
+ */
+static char *sql_migrate_0[] = {
+  /* acl entries refer to an interned hosts table instead of by name */
+  "CREATE TABLE hosts (id INTEGER PRIMARY KEY, name TEXT UNIQUE NOT NULL);",
+  "INSERT INTO hosts (name) SELECT DISTINCT hostname FROM acl;",
+  "DROP TRIGGER IF EXISTS delete_principal_check_ref;",
+  "DROP TRIGGER IF EXISTS insert_acl_check_ref;",
+  "DROP TRIGGER IF EXISTS update_acl_immutables;",
+  "ALTER TABLE acl RENAME TO acl_v0;",
+  "CREATE TABLE acl (principal INTEGER NOT NULL, host INTEGER NOT NULL, completed INTEGER NOT NULL DEFAULT 0, attempted INTEGER NOT NULL DEFAULT 0, UNIQUE (principal, host));",
+  "INSERT INTO acl (principal, host, completed, attempted) SELECT acl_v0.principal, hosts.id, acl_v0.completed, acl_v0.attempted FROM acl_v0, hosts WHERE hosts.name = acl_v0.hostname;",
+  "DROP TABLE acl_v0;",
+  NULL
+};
+
+/* adds the download_journal table, which rekey.sql creates */
+static char *sql_migrate_1[] = {
+  NULL
+};
+
+static char **sql_migrations[] = {
+  sql_migrate_0,
+  sql_migrate_1,
+};
+
+/* sqlite3_exec callback which saves the first column of a result */
+static int sql_get_text(void *arg, int ncol, char **vals, char **names)
+{
+  char *text = arg;
+
+  if (ncol > 0 && vals[0]) {
+    strncpy(text, vals[0], 15);
+    text[15] = 0;
+  }
+  return 0;
+}
+
+static int sql_run(sqlite3 *dbh, char **stmts, char *what)
 {
-  sqlite3 *dbh;
-  int dblock, rc, i;
   char *sql, *errmsg;
+  int rc, i;
 
-  if (sess->dbh)
+  for (sql=stmts[i=0]; sql;sql=stmts[++i]) {
+    rc = sqlite3_exec(dbh, sql, NULL, NULL, &errmsg);
+    if (rc != SQLITE_OK) {
+      if (errmsg) {
+        prtmsg("SQL %s action %d failed: %s", what, i, errmsg);
+        sqlite3_free(errmsg);
+      } else {
+        prtmsg("SQL %s action %d failed: %d", what, i, rc);
+      }
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/* Bring the schema from <version> up to date, in a single transaction */
+static int sql_upgrade(sqlite3 *dbh, int version)
+{
+  char buf[64], name[16];
+  int from = version;
+
+  if (sqlite3_exec(dbh, "BEGIN IMMEDIATE TRANSACTION", NULL, NULL, NULL) !=
+      SQLITE_OK) {
+    prtmsg("Cannot lock database for schema update: %s", sqlite3_errmsg(dbh));
+    return 1;
+  }
+
+  /* a version 0 database with no tables in it is new, not old */
+  name[0] = 0;
+  if (version == 0 &&
+      sqlite3_exec(dbh, "SELECT name FROM sqlite_master WHERE type='table' "
+                   "AND name='acl'", sql_get_text, name, NULL) == SQLITE_OK &&
+      !name[0])
+    version = from = REKEY_SCHEMA_VERSION;
+
+  for (; version < REKEY_SCHEMA_VERSION; version++) {
+    if (sql_run(dbh, sql_migrations[version], "Migration"))
+      goto fail;
+  }
+  if (sql_run(dbh, sql_embeded_init, "Initialization"))
+    goto fail;
+  snprintf(buf, sizeof(buf), "PRAGMA user_version = %d", REKEY_SCHEMA_VERSION);
+  if (sqlite3_exec(dbh, buf, NULL, NULL, NULL) != SQLITE_OK ||
+      sqlite3_exec(dbh, "COMMIT TRANSACTION", NULL, NULL, NULL) != SQLITE_OK) {
+    prtmsg("Cannot update database schema version: %s", sqlite3_errmsg(dbh));
+    goto fail;
+  }
+  if (from < REKEY_SCHEMA_VERSION)
+    syslog(LOG_NOTICE, "Database schema upgraded from version %d to %d",
+           from, REKEY_SCHEMA_VERSION);
+  return 0;
+
+ fail:
+  sqlite3_exec(dbh, "ROLLBACK TRANSACTION", NULL, NULL, NULL);
+  return 1;
+}
+
+/* Returns the schema version of the database, or -1 if it can't be read */
+static int sql_schema_version(sqlite3 *dbh)
+{
+  char version[16];
+
+  version[0] = 0;
+  if (sqlite3_exec(dbh, "PRAGMA user_version", sql_get_text, version, NULL)
+      != SQLITE_OK)
+    return -1;
+  return atoi(version);
+}
+
+/*
+ * Put the database in WAL mode, so that readers and a writer can proceed
+ * at the same time, and create or upgrade the schema if need be.  These
+ * are the only things done under the external lock file; otherwise the
+ * database is locked one transaction at a time.
+ */
+static int sql_setup(sqlite3 *dbh, int created)
+{
+  char mode[16];
+  int dblock, rc, v, ret = 1;
+
+  mode[0] = 0;
+#if SQLITE_VERSION_NUMBER >= 3007000
+  sqlite3_exec(dbh, "PRAGMA journal_mode", sql_get_text, mode, NULL);
+#else
+  strcpy(mode, "wal");          /* nothing to be done */
+#endif
+  if (!created && !strcmp(mode, "wal") &&
+      sql_schema_version(dbh) == REKEY_SCHEMA_VERSION)
     return 0;
-  
+
   dblock = open(REKEY_DATABASE_LOCK, O_WRONLY | O_CREAT, 0644);
   if (dblock < 0) {
     prtmsg("Cannot create/open database lock: %s", strerror(errno));
@@ -353,73 +593,631 @@ int sql_init(struct rekey_session *sess)
     return 1;
   }
 
-#if SQLITE_VERSION_NUMBER >= 3005000
-  rc = sqlite3_open_v2(REKEY_LOCAL_DATABASE, &dbh, SQLITE_OPEN_READWRITE, NULL);
-  if (rc == SQLITE_OK) {
-    sess->db_lock = dblock;
-    sess->dbh = dbh;
-    return 0;
+#if SQLITE_VERSION_NUMBER >= 3007000
+  if (strcmp(mode, "wal")) {
+    rc = sqlite3_exec(dbh, "PRAGMA journal_mode=WAL", sql_get_text, mode,
+                      NULL);
+    if (rc != SQLITE_OK || strcmp(mode, "wal"))
+      prtmsg("warning: cannot put database in WAL mode (%s)",
+             rc == SQLITE_OK ? mode : sqlite3_errmsg(dbh));
   }
-  
-  if (rc != SQLITE_ERROR && rc != SQLITE_CANTOPEN) {
-    prtmsg("Cannot open database: %d", rc);
-    close(dblock);
-    return 1;
+#endif
+
+  /* another process may have done the upgrade while we waited */
+  v = sql_schema_version(dbh);
+  if (v < 0) {
+    prtmsg("Cannot read database schema version: %s", sqlite3_errmsg(dbh));
+    goto out;
+  }
+  if (v > REKEY_SCHEMA_VERSION) {
+    prtmsg("Database schema version %d is newer than this server supports (%d)",
+           v, REKEY_SCHEMA_VERSION);
+    goto out;
+  }
+#if SQLITE_VERSION_NUMBER >= 3003007 /* need support for CREATE TRIGGER IF NOT EXIST */
+  if (created || v < REKEY_SCHEMA_VERSION) {
+    if (sql_upgrade(dbh, created ? REKEY_SCHEMA_VERSION : v))
+      goto out;
   }
+#else
+#warning Automatic database initialization not available
+#endif
+  ret = 0;
+ out:
+  close(dblock);
+  return ret;
+}
 
-  rc = sqlite3_open_v2(REKEY_LOCAL_DATABASE, &dbh, SQLITE_OPEN_READWRITE | 
-                       SQLITE_OPEN_CREATE, NULL);
-  if (rc != SQLITE_OK) { 
-    prtmsg("Cannot create/open database: %d", rc);
-    close(dblock);
-    return 1;
+/* Open the database, creating it if <created> is not NULL (and setting
+   *created if that happened) */
+static int sql_open(sqlite3 **dbhp, int *created)
+{
+  sqlite3 *dbh;
+  int rc;
+
+#if SQLITE_VERSION_NUMBER >= 3005000
+  rc = sqlite3_open_v2(REKEY_LOCAL_DATABASE, &dbh, SQLITE_OPEN_READWRITE, NULL);
+  if (rc != SQLITE_OK) {
+    sqlite3_close(dbh);
+    if (!created || (rc != SQLITE_ERROR && rc != SQLITE_CANTOPEN)) {
+      prtmsg("Cannot open database: %d", rc);
+      return 1;
+    }
+
+    rc = sqlite3_open_v2(REKEY_LOCAL_DATABASE, &dbh, SQLITE_OPEN_READWRITE | 
+                         SQLITE_OPEN_CREATE, NULL);
+    if (rc != SQLITE_OK) { 
+      prtmsg("Cannot create/open database: %d", rc);
+      sqlite3_close(dbh);
+      return 1;
+    }
+    *created = 1;
   }
 #else
   rc = sqlite3_open(REKEY_LOCAL_DATABASE, &dbh);
   if (rc != SQLITE_OK) { 
     prtmsg("Cannot create/open database: %d", rc);
-    close(dblock);
     return 1;
   }
+  if (created)
+    *created = 1;
 #endif
 
   rc = sqlite3_busy_timeout(dbh, 30000);
   if (rc != SQLITE_OK) {
     prtmsg("Failed setting database busy handler: %d", rc);
     sqlite3_close(dbh);
-    close(dblock);
     return 1;
   }
-    
-#if SQLITE_VERSION_NUMBER >= 3003007 /* need support for CREATE TRIGGER IF NOT EXIST */
-  for (sql=sql_embeded_init[i=0]; sql;sql=sql_embeded_init[++i]) {
-    rc = sqlite3_exec(dbh, sql, NULL, NULL, &errmsg);
-    if (rc != SQLITE_OK) {
-      if (errmsg) {
-        prtmsg("SQL Initialization action %d failed: %s", i, errmsg);
-        sqlite3_free(errmsg);
-      } else {
-        prtmsg("SQL Initialization action %d failed: %d", i, rc);
-      }
-      sqlite3_close(dbh);
-      close(dblock);
+  *dbhp = dbh;
+  return 0;
+}
+
+/*
+ * With -j, GETKEYS does not record downloads (acl.attempted and
+ * principals.downloadcount) itself, since that would make every download
+ * a write transaction.  Instead each download is appended to a journal,
+ * which is applied to the database in one transaction once it holds
+ * download_journal_count records or its oldest record is
+ * download_journal_age seconds old.  The journal is also applied at the
+ * start of every other write transaction, as part of it, so COMMITKEY,
+ * FINALIZE and the rest always see every download that happened before
+ * them, and fail rather than go ahead if the journal can't be applied.
+ *
+ * Processes append to the journal under a shared lock; whoever applies
+ * it holds the database write lock and then an exclusive lock on the
+ * journal.  The journal starts with a generation number, which each
+ * record repeats.  The generation and the offset up to which the journal
+ * has been applied are stored in the database in the same transaction as
+ * the updates, so a record is never counted twice, whether or not that
+ * transaction commits.  Once everything in the journal has been
+ * committed, it is emptied and started again with a new generation;
+ * records left behind by a crash part way through carry the old
+ * generation and are ignored.
+ */
+int download_journal_count = 0;
+int download_journal_age = 60;
+
+struct download_rec {
+  sqlite_int64 principal;
+  sqlite_int64 host;
+  krb5_kvno kvno;
+  time_t when;
+  sqlite_int64 generation;
+};
+
+#define JOURNAL_MAGIC 0x726b646a
+
+struct journal_hdr {
+  unsigned int magic;
+  unsigned int unused;
+  sqlite_int64 generation;
+};
+
+static int journal_fd = -1;
+
+/* Start an empty journal.  The caller holds an exclusive lock on it */
+static int journal_start(sqlite_int64 generation)
+{
+  struct journal_hdr hdr;
+
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.magic = JOURNAL_MAGIC;
+  hdr.generation = generation;
+  if (ftruncate(journal_fd, 0) ||
+      write(journal_fd, &hdr, sizeof(hdr)) != sizeof(hdr)) {
+    prtmsg("Cannot reset download journal: %s", strerror(errno));
+    return 1;
+  }
+  return 0;
+}
+
+/* Returns the journal's generation, or 0 if it has no header yet */
+static sqlite_int64 journal_generation(void)
+{
+  struct journal_hdr hdr;
+
+  if (pread(journal_fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+      hdr.magic != JOURNAL_MAGIC)
+    return 0;
+  return hdr.generation;
+}
+
+/* A new journal's generation only has to differ from any the database
+   has seen; later ones count up from it */
+static int journal_init(void)
+{
+  struct timeval now;
+  struct stat st;
+  int rc = 0;
+
+  if (flock(journal_fd, LOCK_EX)) {
+    prtmsg("Cannot lock download journal: %s", strerror(errno));
+    return 1;
+  }
+  if (journal_generation() == 0) {
+    if (fstat(journal_fd, &st) == 0 && st.st_size > sizeof(struct journal_hdr))
+      prtmsg("Discarding download journal %s, which has no valid header",
+             REKEY_DOWNLOAD_JOURNAL);
+    gettimeofday(&now, NULL);
+    rc = journal_start(((sqlite_int64)now.tv_sec << 32) ^
+                       ((sqlite_int64)now.tv_usec << 12) ^ getpid());
+  }
+  flock(journal_fd, LOCK_UN);
+  return rc;
+}
+
+static int journal_open(void)
+{
+  if (journal_fd >= 0)
+    return 0;
+  journal_fd = open(REKEY_DOWNLOAD_JOURNAL, O_RDWR | O_APPEND | O_CREAT, 0600);
+  if (journal_fd < 0) {
+    prtmsg("Cannot open download journal %s: %s", REKEY_DOWNLOAD_JOURNAL,
+           strerror(errno));
+    return 1;
+  }
+  if (journal_init()) {
+    close(journal_fd);
+    journal_fd = -1;
+    return 1;
+  }
+  return 0;
+}
+
+/* Returns the offset of the first record of the journal with this
+   generation that the database has not recorded, or -1 on error */
+static off_t journal_applied(sqlite3 *dbh, sqlite_int64 generation)
+{
+  sqlite3_stmt *state=NULL;
+  off_t off = sizeof(struct journal_hdr);
+
+  if (sqlite3_prepare_v2(dbh, "SELECT generation, offset FROM download_journal WHERE id = 0;",
+                         -1, &state, NULL) != SQLITE_OK)
+    return -1;
+  if (sqlite3_step(state) == SQLITE_ROW &&
+      sqlite3_column_int64(state, 0) == generation)
+    off = sqlite3_column_int64(state, 1);
+  if (sqlite3_finalize(state) != SQLITE_OK)
+    return -1;
+  return off;
+}
+
+/* Apply every complete record in the journal not yet recorded as applied.
+   The caller holds the database write lock and an exclusive lock on the
+   journal. */
+static int journal_apply(sqlite3 *dbh, int *count)
+{
+  sqlite3_stmt *updatt=NULL, *updcount=NULL, *state=NULL;
+  struct download_rec recs[64];
+  struct stat st;
+  sqlite_int64 generation;
+  off_t off;
+  ssize_t len;
+  int i, n, rc;
+
+  *count = 0;
+  generation = journal_generation();
+  if (generation == 0) {
+    prtmsg("Download journal has no header");
+    return 1;
+  }
+  off = journal_applied(dbh, generation);
+  if (off < 0)
+    goto dberr;
+
+  if (fstat(journal_fd, &st)) {
+    prtmsg("Cannot stat download journal: %s", strerror(errno));
+    return 1;
+  }
+  /* a journal only shrinks when its generation changes, so this one was
+     started again with a generation that happened to be reused */
+  if (off > st.st_size) {
+    prtmsg("Download journal is shorter than recorded; applying all of it");
+    off = sizeof(struct journal_hdr);
+  }
+  /* everything here was applied by a committed transaction */
+  if (off == st.st_size && off > sizeof(struct journal_hdr))
+    return journal_start(generation + 1);
+
+  rc = sqlite3_prepare_v2(dbh, "UPDATE acl SET attempted = 1 WHERE principal = ?1 AND host = ?2 AND (SELECT kvno FROM principals WHERE id = ?1) = ?3;",
+                          -1, &updatt, NULL);
+  if (rc != SQLITE_OK)
+    goto dberr;
+  rc = sqlite3_prepare_v2(dbh, "UPDATE principals SET downloadcount = downloadcount + 1 WHERE id = ?1 AND kvno = ?3;",
+                          -1, &updcount, NULL);
+  if (rc != SQLITE_OK)
+    goto dberr;
+
+  while ((len = pread(journal_fd, recs, sizeof(recs), off)) > 0) {
+    n = len / sizeof(struct download_rec);
+    if (n == 0)
+      break; /* partial record left by a crash */
+    off += n * sizeof(struct download_rec);
+    for (i = 0; i < n; i++) {
+      if (recs[i].generation != generation)
+        continue;
+      if (sqlite3_bind_int64(updatt, 1, recs[i].principal) != SQLITE_OK ||
+          sqlite3_bind_int64(updatt, 2, recs[i].host) != SQLITE_OK ||
+          sqlite3_bind_int(updatt, 3, recs[i].kvno) != SQLITE_OK)
+        goto dberr;
+      sqlite3_step(updatt);
+      rc = sqlite3_reset(updatt);
+      if (rc != SQLITE_OK)
+        goto dberr;
+      if (sqlite3_bind_int64(updcount, 1, recs[i].principal) != SQLITE_OK ||
+          sqlite3_bind_int(updcount, 3, recs[i].kvno) != SQLITE_OK)
+        goto dberr;
+      sqlite3_step(updcount);
+      rc = sqlite3_reset(updcount);
+      if (rc != SQLITE_OK)
+        goto dberr;
+      (*count)++;
+    }
+  }
+  if (len < 0) {
+    prtmsg("Cannot read download journal: %s", strerror(errno));
+    goto freeall;
+  }
+
+  rc = sqlite3_prepare_v2(dbh, "INSERT OR REPLACE INTO download_journal (id, generation, offset) VALUES (0, ?, ?);",
+                          -1, &state, NULL);
+  if (rc != SQLITE_OK)
+    goto dberr;
+  if (sqlite3_bind_int64(state, 1, generation) != SQLITE_OK ||
+      sqlite3_bind_int64(state, 2, off) != SQLITE_OK)
+    goto dberr;
+  sqlite3_step(state);
+  rc = sqlite3_finalize(state);
+  state = NULL;
+  if (rc != SQLITE_OK)
+    goto dberr;
+  sqlite3_finalize(updatt);
+  sqlite3_finalize(updcount);
+  return 0;
+
+ dberr:
+  prtmsg("database error: %s", sqlite3_errmsg(dbh));
+ freeall:
+  if (state)
+    sqlite3_finalize(state);
+  if (updatt)
+    sqlite3_finalize(updatt);
+  if (updcount)
+    sqlite3_finalize(updcount);
+  return 1;
+}
+
+static int journal_flush(sqlite3 *dbh)
+{
+  struct stat st;
+  int count;
+
+  if (fstat(journal_fd, &st) == 0 &&
+      st.st_size < sizeof(struct journal_hdr) + sizeof(struct download_rec))
+    return 0;
+  if (sqlite3_exec(dbh, "BEGIN IMMEDIATE TRANSACTION", NULL, NULL, NULL) !=
+      SQLITE_OK) {
+    prtmsg("Cannot lock database to apply download journal: %s",
+           sqlite3_errmsg(dbh));
+    return 1;
+  }
+  if (flock(journal_fd, LOCK_EX)) {
+    prtmsg("Cannot lock download journal: %s", strerror(errno));
+    goto rollback;
+  }
+  if (journal_apply(dbh, &count))
+    goto unlock;
+  if (sqlite3_exec(dbh, "COMMIT TRANSACTION", NULL, NULL, NULL) != SQLITE_OK) {
+    prtmsg("Cannot apply download journal: %s", sqlite3_errmsg(dbh));
+    goto unlock;
+  }
+  /* now that the offset is committed, the records can be discarded */
+  journal_start(journal_generation() + 1);
+  flock(journal_fd, LOCK_UN);
+  if (count)
+    syslog(LOG_DEBUG, "Recorded %d downloads from the journal", count);
+  return 0;
+
+ unlock:
+  flock(journal_fd, LOCK_UN);
+ rollback:
+  sqlite3_exec(dbh, "ROLLBACK TRANSACTION", NULL, NULL, NULL);
+  return 1;
+}
+
+/* Apply the journal as part of the transaction the caller has begun */
+static int journal_apply_trans(sqlite3 *dbh)
+{
+  int count, rc;
+
+  if (journal_open())
+    return 1;
+  if (flock(journal_fd, LOCK_EX)) {
+    prtmsg("Cannot lock download journal: %s", strerror(errno));
+    return 1;
+  }
+  rc = journal_apply(dbh, &count);
+  flock(journal_fd, LOCK_UN);
+  if (rc == 0 && count)
+    syslog(LOG_DEBUG, "Recorded %d downloads from the journal", count);
+  return rc;
+}
+
+/* Append a download to the journal */
+int sql_log_download(struct rekey_session *sess, sqlite_int64 principal,
+                     sqlite_int64 host, krb5_kvno kvno)
+{
+  struct download_rec rec;
+  ssize_t len;
+
+  if (journal_open())
+    return 1;
+  memset(&rec, 0, sizeof(rec));
+  rec.principal = principal;
+  rec.host = host;
+  rec.kvno = kvno;
+  rec.when = time(0);
+  if (flock(journal_fd, LOCK_SH)) {
+    prtmsg("Cannot lock download journal: %s", strerror(errno));
+    return 1;
+  }
+  rec.generation = journal_generation();
+  if (rec.generation == 0) {
+    /* a crash while the journal was being emptied left no header */
+    flock(journal_fd, LOCK_UN);
+    if (journal_init() || flock(journal_fd, LOCK_SH)) {
+      prtmsg("Cannot start download journal");
       return 1;
     }
+    rec.generation = journal_generation();
   }
-#else
-#warning Automatic database initialization not available
-#endif
-  sess->db_lock = dblock;
-  sess->dbh = dbh;
+  len = write(journal_fd, &rec, sizeof(rec));
+  flock(journal_fd, LOCK_UN);
+  if (len != sizeof(rec)) {
+    prtmsg("Cannot write download journal: %s",
+           len < 0 ? strerror(errno) : "short write");
+    return 1;
+  }
+  return 0;
+}
+
+/* Apply the download journal if it is due, or unconditionally if <force>
+   is set */
+int sql_flush_downloads(struct rekey_session *sess, int force)
+{
+  struct download_rec first;
+  struct stat st;
+  off_t start;
+
+  if (download_journal_count <= 0)
+    return 0;
+  if (journal_open())
+    return 1;
+  if (!force) {
+    if (fstat(journal_fd, &st))
+      return 1;
+    /* records a transaction has already applied don't count; they are
+       discarded by the next flush that has something to do */
+    start = journal_applied(sess->dbh, journal_generation());
+    if (start < 0 || start > st.st_size)
+      start = sizeof(struct journal_hdr);
+    if (st.st_size - start < sizeof(struct download_rec))
+      return 0;
+    if (st.st_size - start <
+        download_journal_count * sizeof(struct download_rec) &&
+        (pread(journal_fd, &first, sizeof(first), start) != sizeof(first) ||
+         first.when + download_journal_age > time(0)))
+      return 0;
+  }
+  return journal_flush(sess->dbh);
+}
+
+/*
+ * Create the database, or bring its schema up to date, and put it in WAL
+ * mode.  This is done once when the server starts (or by rekeysrv -I), so
+ * that each session need only open the database and check its version.
+ */
+int sql_startup(void)
+{
+  sqlite3 *dbh;
+  int rc, created = 0;
+
+  if (sql_open(&dbh, &created))
+    return 1;
+  rc = sql_setup(dbh, created);
+  /* record any downloads left over from the last time the server ran */
+  if (rc == 0 && access(REKEY_DOWNLOAD_JOURNAL, F_OK) == 0 &&
+      journal_open() == 0) {
+    rc = journal_flush(dbh);
+    close(journal_fd);
+    journal_fd = -1;
+  }
+  sqlite3_close(dbh);
+  return rc;
+}
+
+/*
+ * Each process opens the database once, the first time a session needs
+ * it, and keeps it open for every later session it serves.  Sessions
+ * only use the handle while processing a request, so they never overlap.
+ * Statements prepared through sql_prepare() are cached with the handle
+ * and reused; a statement is only prepared again if it is still in use
+ * when it is asked for a second time.
+ */
+struct sql_stmt_cache {
+  struct sql_stmt_cache *next;
+  const char *sql;
+  sqlite3_stmt *stmt;
+  int busy;
+};
+
+static sqlite3 *proc_dbh;
+static struct sql_stmt_cache *stmt_cache;
+
+int sql_init(struct rekey_session *sess) 
+{
+  sqlite3 *dbh;
+  int v;
+
+  if (sess->dbh)
+    return 0;
+  if (proc_dbh) {
+    sess->dbh = proc_dbh;
+    return 0;
+  }
+
+  if (sql_open(&dbh, NULL))
+    return 1;
+  v = sql_schema_version(dbh);
+  if (v != REKEY_SCHEMA_VERSION) {
+    prtmsg("Database schema version is %d, not %d; run rekeysrv -I",
+           v, REKEY_SCHEMA_VERSION);
+    sqlite3_close(dbh);
+    return 1;
+  }
+  sess->dbh = proc_dbh = dbh;
   return 0;
 }
 
+/* Detach the session from the database.  Anything it left behind (an open
+   transaction, a statement that was never finished) is cleaned up so that
+   the next session starts from a known state. */
+void sql_release(struct rekey_session *sess) 
+{
+  struct sql_stmt_cache *c;
+#if SQLITE_VERSION_NUMBER >= 3006000
+  sqlite3_stmt *stmt, *next;
+#endif
+
+  if (!sess->dbh)
+    return;
+  for (c = stmt_cache; c; c = c->next) {
+    if (c->busy) {
+      sqlite3_reset(c->stmt);
+      sqlite3_clear_bindings(c->stmt);
+      c->busy = 0;
+    }
+  }
+#if SQLITE_VERSION_NUMBER >= 3006000
+  /* statements not in the cache belong to a handler which was cut short
+     (by fatal() in the event loop); nothing else will finalize them */
+  for (stmt = sqlite3_next_stmt(sess->dbh, NULL); stmt; stmt = next) {
+    next = sqlite3_next_stmt(sess->dbh, stmt);
+    for (c = stmt_cache; c; c = c->next)
+      if (c->stmt == stmt)
+        break;
+    if (!c)
+      sqlite3_finalize(stmt);
+  }
+#endif
+  if (!sqlite3_get_autocommit(sess->dbh)) {
+    prtmsg("Rolling back transaction left open by session");
+    sqlite3_exec(sess->dbh, "ROLLBACK TRANSACTION", NULL, NULL, NULL);
+  }
+  sess->dbh = NULL;
+}
+
+/* Like sqlite3_prepare_v2, but returns a cached statement if there is
+   one.  The statement must be passed to sql_finish when it is done. */
+int sql_prepare(struct rekey_session *sess, const char *sql,
+                sqlite3_stmt **stmtp)
+{
+  struct sql_stmt_cache *c;
+  int rc;
+
+  *stmtp = NULL;
+  for (c = stmt_cache; c; c = c->next) {
+    if (!c->busy && (c->sql == sql || !strcmp(c->sql, sql))) {
+      c->busy = 1;
+      *stmtp = c->stmt;
+      return SQLITE_OK;
+    }
+  }
+
+  c = malloc(sizeof(struct sql_stmt_cache));
+  if (!c)
+    return SQLITE_NOMEM;
+  rc = sqlite3_prepare_v2(sess->dbh, sql, -1, &c->stmt, NULL);
+  if (rc != SQLITE_OK) {
+    free(c);
+    return rc;
+  }
+  c->sql = sql;
+  c->busy = 1;
+  c->next = stmt_cache;
+  stmt_cache = c;
+  *stmtp = c->stmt;
+  return SQLITE_OK;
+}
+
+/* Reset a statement from sql_prepare and return it to the cache.  Like
+   sqlite3_finalize, returns the error (if any) from the last step. */
+int sql_finish(sqlite3_stmt *stmt)
+{
+  struct sql_stmt_cache *c;
+  int rc;
+
+  if (!stmt)
+    return SQLITE_OK;
+  rc = sqlite3_reset(stmt);
+  sqlite3_clear_bindings(stmt);
+  for (c = stmt_cache; c; c = c->next) {
+    if (c->stmt == stmt) {
+      c->busy = 0;
+      return rc;
+    }
+  }
+  /* not one of ours */
+  sqlite3_finalize(stmt);
+  return rc;
+}
+
+/*
+ * Transactions are started with BEGIN IMMEDIATE, which takes the write
+ * lock up front, so that two writers never both read and then fail to
+ * upgrade.  Readers outside a transaction are not blocked.  Time spent
+ * waiting for the lock is accumulated in the session, and logged when
+ * it is long.
+ */
 int sql_begin_trans(struct rekey_session *sess) 
 {
+  struct timeval start, end;
   char *errmsg;
+  long waited;
   int rc;
   
-  rc = sqlite3_exec(sess->dbh, "BEGIN TRANSACTION", NULL, NULL, &errmsg);
+  gettimeofday(&start, NULL);
+  rc = sqlite3_exec(sess->dbh, "BEGIN IMMEDIATE TRANSACTION", NULL, NULL, &errmsg);
+  gettimeofday(&end, NULL);
+  waited = (end.tv_sec - start.tv_sec) * 1000 +
+    (end.tv_usec - start.tv_usec) / 1000;
+  if (waited > 0)
+    sess->db_wait += waited;
+  sess->db_trans++;
+  if (waited >= 1000)
+    syslog(LOG_WARNING, "Waited %ld ms for the database lock", waited);
+
   if (rc != SQLITE_OK) {
     if (errmsg) {
       prtmsg("SQL BEGIN TRANSACTION failed: %s", errmsg);
@@ -429,6 +1227,12 @@ int sql_begin_trans(struct rekey_session *sess)
     }
     return 1;
   }
+  /* downloads must be recorded before anything depending on them */
+  if (download_journal_count > 0 && journal_apply_trans(sess->dbh)) {
+    prtmsg("Cannot record journaled downloads; abandoning transaction");
+    sqlite3_exec(sess->dbh, "ROLLBACK TRANSACTION", NULL, NULL, NULL);
+    return 1;
+  }
   return 0;
 }
 
@@ -455,6 +1259,9 @@ int sql_rollback_trans(struct rekey_session *sess)
   char *errmsg;
   int rc;
   
+  /* the request setup_principal remembered is being undone; its rowid
+     may be given to another principal */
+  sess->setup_princid = 0;
   rc = sqlite3_exec(sess->dbh, "ROLLBACK TRANSACTION", NULL, NULL, &errmsg);
   if (rc != SQLITE_OK) {
     if (errmsg) {
@@ -44,6 +44,8 @@
 #include "config.h"
 #endif
 
+#include <time.h>
+
 #define SESS_PRIVATE
 #include "rekeysrv-locl.h"
 
@@ -88,11 +90,60 @@ static void usage(void)
   fputs("Usage: try_acl b[e] <subj>         test subj against builtin acl\n"
         "       try_acl f[e] <file> <subj>  test subj against file\n"
         "       try_acl s[e] <pat> <subj>   test subj against pattern\n"
-        "       try_acl o <file>            print builtin acl to file\n",
+        "       try_acl o <file>            print builtin acl to file\n"
+        "       try_acl t[e] <file> <count> <subj>...\n"
+        "                                   compare indexed and linear lookups\n",
         stderr);
   exit(2);
 }
 
+/*
+ * Check each subject with both the indexed and the linear matcher and
+ * report any disagreement, then time <count> passes over all subjects
+ * with each.  Exits 0 if the two always agreed.
+ */
+static int compare_acl(struct rekey_session *sess, struct ACL *acl,
+                       int exact, int count, int nsubj, char **names)
+{
+  krb5_principal *subjects;
+  clock_t t, indexed, linear;
+  int i, n, rc, lrc, mismatch = 0;
+
+  if (!(subjects = calloc(nsubj, sizeof(krb5_principal))))
+    fatal("Out of memory!");
+  for (i = 0; i < nsubj; i++) {
+    if ((rc = krb5_parse_name(sess->kctx, names[i], &subjects[i])))
+      fatal("%s: %s\n", names[i], krb5_get_err_text(sess->kctx, rc));
+    rc = acl_check(sess, acl, subjects[i], exact);
+    lrc = acl_check_linear(sess, acl, subjects[i], exact);
+    if (rc != lrc) {
+      fprintf(stderr, "%s: indexed %d, linear %d\n", names[i], rc, lrc);
+      mismatch++;
+    }
+  }
+
+  t = clock();
+  for (n = 0; n < count; n++)
+    for (i = 0; i < nsubj; i++)
+      acl_check(sess, acl, subjects[i], exact);
+  indexed = clock() - t;
+
+  t = clock();
+  for (n = 0; n < count; n++)
+    for (i = 0; i < nsubj; i++)
+      acl_check_linear(sess, acl, subjects[i], exact);
+  linear = clock() - t;
+
+  printf("%d lookups: indexed %.3fs, linear %.3fs, %d mismatches\n",
+         count * nsubj, (double)indexed / CLOCKS_PER_SEC,
+         (double)linear / CLOCKS_PER_SEC, mismatch);
+
+  for (i = 0; i < nsubj; i++)
+    krb5_free_principal(sess->kctx, subjects[i]);
+  free(subjects);
+  return mismatch ? 1 : 0;
+}
+
 int main(int argc, char **argv)
 {
   struct rekey_session *sess;
@@ -100,7 +151,7 @@ int main(int argc, char **argv)
   struct ACL *acl;
   FILE *F;
   char *string_acl[3], **x;
-  int rc, exact = 0;
+  int rc, count, exact = 0;
 
   if (argc < 2) usage();
 
@@ -142,6 +193,14 @@ int main(int argc, char **argv)
       fclose(F);
       exit(0);
 
+    case 't':
+      if (argc < 5) usage();
+      exact = ((*argv)[1] == 'e');
+      sess = setup_session();
+      acl = acl_load(sess, *++argv);
+      if ((count = atoi(*++argv)) < 1) usage();
+      exit(compare_acl(sess, acl, exact, count, argc - 4, argv + 1));
+
     default: usage();
   }
 